@@ -7,7 +7,8 @@ import os
 my_path = os.path.dirname(os.path.abspath(__file__))
 _mojave = cdll.LoadLibrary(my_path + '/_mojave.so')
 
-def _do_mojave(queue, X, cl, window_name, my_path):
+def _do_mojave(queue, X, cl, window_name, my_path, fps):
+    _mojave.mojave_set_fps(c_double(fps))
     Xa = np.require(X, dtype = 'float64', requirements = 'C')
     Xp = Xa.ctypes._as_parameter_
     cl_a = np.require(np.array(cl).copy(), dtype = 'int32', requirements = 'C')
@@ -16,7 +17,7 @@ def _do_mojave(queue, X, cl, window_name, my_path):
                    window_name.encode(), my_path.encode())
     queue.put(cl_a)
     
-def mojave(X, cl = None, window_name = 'Mojave'):
+def mojave(X, cl = None, window_name = 'Mojave', fps = 60):
     """Mojave - Multidimensional Orthographic Joint Analytic Visual Explorer
 
     Parameters
@@ -25,19 +26,26 @@ def mojave(X, cl = None, window_name = 'Mojave'):
         2-d array shape (data_size,dimension) usually data_size >> dimension.
     cl : array_like, optional
         Cluster labels (or colors), we make up colors and glyphs.
+    window_name : str, optional
+        Title of the point window.
+    fps : float, optional
+        Target frame rate, while moving fewer points are drawn to keep it.
 
     KEYS:
        A              : About Mojave
        C              : Change color mode
        D              : Decimate
        E              : Eraser mode
+       G              : Change render path (per-point/geometry/software)
        H              : Hide current color
        I              : Info
+       L              : HDR mode (log tone mapped intensity)
        N              : Next color
        O              : Color picker      
        Q              : Quit
        R              : Rotation mode
        S              : Zoom Standard
+       V              : Density view (off/on/smoothed)
        X              : x/y plots
        Y              : Redo
        Z              : Undo
@@ -108,7 +116,7 @@ def mojave(X, cl = None, window_name = 'Mojave'):
     if cl is None:
         cl = np.zeros(len(X))
     queue = mp.Queue()
-    args = [queue, X1, cl, window_name, my_path]
+    args = [queue, X1, cl, window_name, my_path, fps]
     p = mp.Process(target = _do_mojave, args = args)
     p.start()
     result = queue.get()
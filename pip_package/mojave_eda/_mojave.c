@@ -6,18 +6,24 @@
 #include <SDL2/SDL_mouse.h>
 #include <SDL2/SDL_render.h>
 #include <SDL2/SDL_surface.h>
+#include <SDL2/SDL_thread.h>
 #include <SDL2/SDL_timer.h>
 #include <SDL2/SDL_video.h>
 #include <SDL2/SDL_ttf.h>
+#include <SDL2/SDL_cpuinfo.h>
+#include <float.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 #define FPS 60
-#define FRAME_DELAY (1000 / FPS)
 
 #define IMAGE_ERASE_FILE "images/mojave_erase.bmp"
 #define IMAGE_PALETTE_FILE "images/mojave_palette.bmp"
@@ -107,12 +113,12 @@
 #define PIE_CHART_X 500
 #define PIE_CHART_Y 90
 
-#define R_POWERS 13
+#define RY_EXTRA_LAYERS 2
 #define RX_THETA_MAX 0.01
 #define RY_THETA_MAX 0.01
 #define KEYBOARD_ROTATION_DX 0
 #define KEYBOARD_ROTATION_DY 10
-#define UNDO_SIZE 1024
+#define ROTATION_MAX_ELAPSED 0.1
 #define MAX_TEXT_NUMBER 256
 #define GRID_COLOR 0x808080
 #define DEFAULT_POINT_SIZE 3
@@ -121,6 +127,34 @@
 #define POINT_SIZE_STEP 0.75
 #define MAX_DECIMATION_MODE 4
 #define XY_BINS 100
+#define XX_MAX_COUNTS (1 << 24)
+#define RENDER_MODE_POINT 0
+#define RENDER_MODE_GEOMETRY 1
+#define RENDER_MODE_SOFTWARE 2
+#define RENDER_MODES 3
+#define REFRESH_TONE 2
+#define REFRESH_MORE 3
+#define PERM_FIRST_SLICE (1 << 18)
+#define STAGE_PROJ 0
+#define STAGE_POINTS 1
+#define STAGE_CONTROLS 2
+#define STAGE_PALETTE 3
+#define STAGE_OTHER 4
+#define STAGES 5
+#define MIN_TARGET_FPS 1.0
+#define HDR_LUT_SIZE 4096
+#define DENSITY_MODE_OFF 0
+#define DENSITY_MODE_SMOOTH 2
+#define DENSITY_MODES 3
+#define DENSITY_MAX_PIXELS (1 << 22)
+#define DENSITY_SIGMA 1.5
+#define DENSITY_RADIUS 4
+#define BATCH_POINTS 16384
+#define MAX_WORKERS 64
+#define POOL_CHUNK 4096
+#define PROJ_MAX_PATCHES 256
+#define GRID_SHIFT 3
+#define FRAME_ORTHO_STEPS 64
 
 #define SQR(x) ((x)*(x))
 #define LCG(x) ((134775813 * (x) + 2531011) & 0xffffff)
@@ -130,7 +164,7 @@
 #define ERROR(x) {fprintf(stderr,"ERROR: ");fprintf(stderr,(x));fprintf(stderr,"\n");exit(1);}
 #define point(i, x, y) pnt[i][(int)(x) + (int)(y)*SCREEN_WIDTH[i]]
 #define AA(i, j) ((i)*dim + (j))
-#define RR(k, i, j) ((k) * dim * dim + (i) * dim + (j))
+#define AF(i, j) ((i)*2 + (j))
 #define MIN(x,y) ((x)<(y)) ? (x) : (y)
 #define MAX(x,y) ((x)<(y)) ? (y) : (x)
 
@@ -154,16 +188,84 @@ TTF_Font* font;
 char ttf_file[FONT_NUM_LOCATIONS][MAX_STRING] = TTF_FILE_FILES;
 
 // Global transform data
-// A shape (dim, dim) is the projection onto the first 2 dimensions.
-// R is such that R[k] = R^(2^k)
+// A shape (dim, 2) is the orthonormal frame projecting onto the screen,
+// i.e. the first 2 columns of the accumulated rotation.
+// Rx is the rotation by rx_theta in the rx_dim1/rx_dim2 plane.
+// Ry = Q L Q^T is kept as Givens rotations (ry_dim1[k], ry_dim2[k], ry_theta[k]):
+// the first ry_basis_count make up Q, the rest (disjoint pairs) make up L.
 double *A;
+int frame_steps = 0;
 double rotation_direction_exists = 0;
-double *Rx;
-double *Rx_inv;
-double *Ry;
-double *Ry_inv;
+int rx_dim1 = 0;
+int rx_dim2 = 1;
+double rx_theta = 0.0;
+int *ry_dim1;
+int *ry_dim2;
+double *ry_theta;
+int ry_basis_count = 0;
+int ry_count = 0;
 int dim;
 
+// Projection cache
+// proj_x/proj_y are the data times the first 2 columns of A (before zoom).
+// A pending rotation in the proj_dim1/proj_dim2 plane by proj_theta is
+// patched in with 2 terms per point, anything else recomputes.
+// screen_x/screen_y are the same points in point window coordinates.
+double * proj_x = NULL;
+double * proj_y = NULL;
+float * screen_x = NULL;
+float * screen_y = NULL;
+int proj_valid = 0;
+int proj_patches = 0;
+int proj_pending = 0;
+int proj_dim1 = 0;
+int proj_dim2 = 0;
+double proj_theta = 0.0;
+
+// Screen cache tags, brushing and picking reuse the last frame's coordinates
+// while they match. proj_version is bumped whenever proj_x/proj_y change.
+unsigned proj_version = 1;
+unsigned screen_version = 0;
+double screen_zoom = 0.0;
+
+// x/y matrix cache: column i is the in-cell offset of dim xy_col_dim[i] for
+// every point, cell (i,j) is then just (cell origin + column i, column j).
+// xy_pixel holds the same quantized to pixels, point by point: entry
+// [k][i] is the x of point k in cell column i and its y in cell row i.
+float * xy_col = NULL;
+int16_t (*xy_pixel)[2] = NULL;
+int * xy_col_dim = NULL;
+int xy_col_cnt = 0;
+int xy_col_capacity = 0;
+double xy_col_zoom = 0.0;
+unsigned xy_col_version = 0;
+
+// Screen bucket grid, cells of 1 << GRID_SHIFT pixels, over the points at
+// (grid_ox + grid_px[k], grid_oy + grid_py[k]): screen_x/screen_y, or a pair
+// of x/y matrix columns placed at their cell.
+// Cell c holds grid_index[grid_start[c] .. grid_start[c+1]), in index order.
+// Rebuilt when the source, its version or the zoom change.
+int * grid_index = NULL;
+int * grid_start = NULL;
+int * grid_count = NULL;
+int grid_w = 0;
+int grid_h = 0;
+float * grid_px = NULL;
+float * grid_py = NULL;
+double grid_ox = 0.0;
+double grid_oy = 0.0;
+unsigned grid_version = 0;
+double grid_zoom = 0.0;
+
+// Active rows of A (nonzero in either column) and their weights, gathered
+// (so with all rows active active_a0/active_a1 are the columns of A).
+// Cleared whenever A changes.
+int * active_dim = NULL;
+double * active_a0 = NULL;
+double * active_a1 = NULL;
+int active_cnt = 0;
+int active_valid = 0;
+
 // Global image stuff
 SDL_Surface *image_erase;
 SDL_Surface *image_palette;
@@ -185,6 +287,58 @@ double point_size = DEFAULT_POINT_SIZE;
 SDL_Surface * point_surface = NULL;
 SDL_Texture * point_texture = NULL;
 
+// Render path (per-point copies or batched geometry)
+int render_mode = RENDER_MODE_GEOMETRY;
+char * render_mode_name[RENDER_MODES] = {"point", "geometry", "software"};
+
+// Batched point quads, BATCH_POINTS at a time.
+SDL_Vertex * batch_vertex = NULL;
+int * batch_index = NULL;
+int batch_count = 0;
+
+// Software splats (gamma mapped colors) rasterized into pnt[POINT_SCREEN].
+// splat_span[dy + splat_radius] is the half width of the disc on row dy.
+// With splat_keep they go on top of the last image instead of a clear one.
+// splat_order lists the splats by row, row y from splat_row[y] on.
+int16_t (*splat_xy)[2] = NULL;
+uint32_t * splat_color = NULL;
+int * splat_order = NULL;
+int * splat_row = NULL;
+int splat_row_capacity = 0;
+int splat_count = 0;
+int splat_capacity = 0;
+int splat_radius = 0;
+int splat_span[2 * MAX_POINT_SIZE + 1];
+int splat_keep = 0;
+
+// HDR mode: splats add linear colors into per pixel r,g,b sums (255 is one
+// full channel), which a log tone map then brings into pnt[POINT_SCREEN].
+// hdr_valid while the sums are those of the last full draw.
+int hdr_on = 0;
+int hdr_valid = 0;
+uint32_t (*hdr_accum)[4] = NULL;
+int hdr_capacity = 0;
+uint32_t hdr_band_max[MAX_WORKERS];
+uint32_t hdr_max = 0;
+unsigned char hdr_lut[HDR_LUT_SIZE];
+
+// Density view: each worker bins the visible points into its own screen
+// sized tile of r,g,b sums and counts, the tiles are merged (and smoothed)
+// into density_sum and shown log scaled. density_valid while density_sum
+// is that of the last full draw.
+int density_mode = DENSITY_MODE_OFF;
+char * density_mode_name[DENSITY_MODES] = {"off", "on", "smoothed"};
+int density_valid = 0;
+uint32_t (*density_tile)[4] = NULL;
+size_t density_tile_capacity = 0;
+int density_tiles = 1;
+float (*density_sum)[4] = NULL;
+float (*density_tmp)[4] = NULL;
+int density_capacity = 0;
+float density_band_max[MAX_WORKERS];
+float density_max = 1.0;
+float density_kernel[DENSITY_RADIUS + 1];
+
 // Pallete = (x >> mask_location) & 7
 int mask_location = 0;
 
@@ -200,6 +354,23 @@ uint32_t decimation_color[MAX_DECIMATION_MODE] = {0x000080, 0x008000, 0x808000,
                                                   0x800000};
 int decimation[MAX_DECIMATION_MODE] = {1,10,100,1000};
 
+// Progressive rendering: the visible points in the order of the random
+// permutation perm (perm_visible) are drawn a prefix sized to the frame
+// budget at a time, and idle frames carry on until perm_limit (num_visible
+// over the decimation) is drawn.
+int * perm = NULL;
+int perm_drawn = 0;
+int perm_limit = 0;
+double perm_rate = 0.0;
+
+// Frame budget: running mean cost in ms of each stage of a frame, the
+// points get whatever the others leave of 1000 / target_fps.
+double target_fps = FPS;
+double stage_ms[STAGES];
+double stage_frame_ms = 0.0;
+char * stage_name[STAGES] = {"projection", "points", "controls", "palette",
+			     "other"};
+
 // brush info
 int brush_color_mode = 0;
 int brush_xsize = DEFAULT_BRUSH_XSIZE;
@@ -231,14 +402,101 @@ int rotation_mode = 0;
 int rotation_mode_color[2] = {0xff0000, 0x00ff00}; 
 int erase_mode_on = 0;
 
+// Worker pool (worker 0 is the main thread)
+int num_workers = 1;
+int workers_quit = 0;
+SDL_Thread * worker_thread[MAX_WORKERS];
+SDL_sem * worker_go[MAX_WORKERS];
+SDL_sem * worker_done = NULL;
+void (*worker_job)(int w, void * arg) = NULL;
+void * worker_arg = NULL;
+
+// pool_for state, chunks of POOL_CHUNK points handed out from pool_next
+SDL_atomic_t pool_next;
+int pool_n = 0;
+void (*pool_range)(int w, int k0, int k1, void * arg) = NULL;
+
+// Hidden points, one bit per point (the bits past num_data are set).
+#define HIDDEN(hide,k) (((hide)[(k) >> 6] >> ((k) & 63)) & 1)
+
+// Visible points in index order, and perm_visible the same points in the
+// order of perm for the progressive drawing. Edits that change visibility
+// clear visible_valid and both are rebuilt on next use, at most once a frame.
+int * visible = NULL;
+int * perm_visible = NULL;
+int num_visible = 0;
+int visible_valid = 0;
+int visible_count[MAX_WORKERS];
+int perm_visible_count[MAX_WORKERS];
+
+// Display color of every point (gamma mapped unless in HDR mode), valid while the color mode,
+// mask location and gamma match the ones it was made with
+uint32_t * display_color = NULL;
+int display_mode = -1;
+int display_mask = -1;
+double display_gamma = -1.0;
+
+// Color table: label -> number of points with it and how many are hidden.
+// Open addressing with linear probing, count < 0 marks an empty slot and
+// labels whose count drops to 0 keep their slot. The capacity is
+// 1 << (32 - color_table_shift).
+struct color_entry
+{
+  int32_t label;
+  int count;
+  int hidden;
+};
+struct color_entry * color_table = NULL;
+int color_table_capacity = 0;
+int color_table_shift = 32;
+int color_table_used = 0;
+
+// Pie chart slices, the color table sorted by display color then label
+struct pie_slice
+{
+  unsigned rgb;
+  int32_t label;
+  int start;
+  int count;
+  int group_end;
+  int group_visible_end;
+};
+
 // Undo info
-int undo_length = 1;
-int max_undo_length = 1;
+// Each edit logs (index, old color, old hide) into its worker's buffer, these
+// are gathered into undo_log in worker order. Operation i is the entries
+// undo_op[i] .. undo_op[i+1] of undo_log, the first undo_top are applied.
+struct undo_entry
+{
+  int32_t index;
+  int32_t color;
+  int32_t hide;
+};
+struct undo_buffer
+{
+  struct undo_entry * entry;
+  size_t length;
+  size_t capacity;
+};
+struct undo_buffer undo_log = {NULL, 0, 0};
+struct undo_buffer undo_worker[MAX_WORKERS];
+size_t * undo_op = NULL;
+int undo_ops = 0;
+int undo_top = 0;
+int undo_op_capacity = 0;
 
 // Mouse info
 int last_mouse_x = -1;
 int last_mouse_y = -1;
 
+// Rotation of the mouse motions of this frame, applied once after them
+int motion_dx = 0;
+int motion_dy = 0;
+
+// Last point the brush stroke reached, -1 between strokes
+int stroke_x = -1;
+int stroke_y = -1;
+
 void about()
 {
   printf("MOJAVE by Kevin Player\n");
@@ -246,12 +504,202 @@ void about()
   printf("https://github.com/kjplaye/mojave\n\n");
 }
 
+int worker_main(void * arg)
+{
+  int w = (intptr_t) arg;
+  while (1)
+    {
+      SDL_SemWait(worker_go[w]);
+      if (workers_quit) break;
+      worker_job(w, worker_arg);
+      SDL_SemPost(worker_done);
+    }
+  return 0;
+}
+
+// Start one worker per core
+void pool_init()
+{
+  num_workers = SDL_GetCPUCount();
+  if (num_workers > MAX_WORKERS) num_workers = MAX_WORKERS;
+  if (num_workers < 1) num_workers = 1;
+  if ((worker_done = SDL_CreateSemaphore(0)) == NULL)
+    ERROR("SDL_CreateSemaphore failure");
+  for(int w=1;w<num_workers;w++)
+    {
+      if ((worker_go[w] = SDL_CreateSemaphore(0)) == NULL)
+	ERROR("SDL_CreateSemaphore failure");
+      worker_thread[w] = SDL_CreateThread(worker_main, "worker",
+					  (void *) (intptr_t) w);
+      if (worker_thread[w] == NULL)
+	{
+	  SDL_DestroySemaphore(worker_go[w]);
+	  num_workers = w;
+	  break;
+	}
+    }
+}
+
+// Stop and join the workers
+void pool_quit()
+{
+  workers_quit = 1;
+  for(int w=1;w<num_workers;w++) SDL_SemPost(worker_go[w]);
+  for(int w=1;w<num_workers;w++)
+    {
+      SDL_WaitThread(worker_thread[w], NULL);
+      SDL_DestroySemaphore(worker_go[w]);
+    }
+  SDL_DestroySemaphore(worker_done);
+  num_workers = 1;
+}
+
+// Run job(w, arg) on every worker w and wait for all of them
+void pool_run(void (*job)(int w, void * arg), void * arg)
+{
+  worker_job = job;
+  worker_arg = arg;
+  for(int w=1;w<num_workers;w++) SDL_SemPost(worker_go[w]);
+  job(0, arg);
+  for(int w=1;w<num_workers;w++) SDL_SemWait(worker_done);
+}
+
+void pool_for_job(int w, void * arg)
+{
+  while (1)
+    {
+      int k0 = SDL_AtomicAdd(&pool_next, POOL_CHUNK);
+      if (k0 >= pool_n) break;
+      int k1 = (k0 + POOL_CHUNK < pool_n) ? k0 + POOL_CHUNK : pool_n;
+      pool_range(w, k0, k1, arg);
+    }
+}
+
+// Run range(w, k0, k1, arg) over [0,n) in chunks, idle workers take the next
+void pool_for(int n, void (*range)(int w, int k0, int k1, void * arg), void * arg)
+{
+  if (n <= POOL_CHUNK || num_workers == 1)
+    {
+      range(0, 0, n, arg);
+      return;
+    }
+  pool_n = n;
+  pool_range = range;
+  SDL_AtomicSet(&pool_next, 0);
+  pool_run(pool_for_job, arg);
+}
+
+// Hide point k, workers may share its word
+static inline void hide_set(uint64_t * hide, int k)
+{
+  __atomic_fetch_or(&hide[k >> 6], 1ULL << (k & 63), __ATOMIC_RELAXED);
+}
+
+// Show point k
+static inline void hide_clear(uint64_t * hide, int k)
+{
+  __atomic_fetch_and(&hide[k >> 6], ~(1ULL << (k & 63)), __ATOMIC_RELAXED);
+}
+
+// Clear the bitset to all visible, the padding bits past num_data hidden
+void hide_reset(uint64_t * hide, int num_data)
+{
+  int words = (num_data + 63) >> 6;
+  for(int i=0;i<words;i++) hide[i] = 0;
+  if (num_data & 63) hide[words - 1] = ~0ULL << (num_data & 63);
+}
+
+// Arguments of the visible list jobs
+struct visible_job
+{
+  uint64_t * hide;
+  int num_data;
+};
+
+// Stream compaction pass 1, visible points in this worker's share of words
+// and of perm
+void visible_count_job(int w, void * arg)
+{
+  struct visible_job * job = arg;
+  int words = (job->num_data + 63) >> 6;
+  int i0 = (int64_t) words * w / num_workers;
+  int i1 = (int64_t) words * (w + 1) / num_workers;
+  int n = 0;
+  for(int i=i0;i<i1;i++) n += __builtin_popcountll(~job->hide[i]);
+  visible_count[w] = n;
+  int m0 = (int64_t) job->num_data * w / num_workers;
+  int m1 = (int64_t) job->num_data * (w + 1) / num_workers;
+  n = 0;
+  for(int m=m0;m<m1;m++) n += !HIDDEN(job->hide, perm[m]);
+  perm_visible_count[w] = n;
+}
+
+// Stream compaction pass 2, write them from this worker's offsets
+void visible_scatter_job(int w, void * arg)
+{
+  struct visible_job * job = arg;
+  int words = (job->num_data + 63) >> 6;
+  int i0 = (int64_t) words * w / num_workers;
+  int i1 = (int64_t) words * (w + 1) / num_workers;
+  int * out = visible + visible_count[w];
+  for(int i=i0;i<i1;i++)
+    {
+      uint64_t word = ~job->hide[i];
+      while (word)
+	{
+	  *out++ = (i << 6) + __builtin_ctzll(word);
+	  word &= word - 1;
+	}
+    }
+  int m0 = (int64_t) job->num_data * w / num_workers;
+  int m1 = (int64_t) job->num_data * (w + 1) / num_workers;
+  out = perm_visible + perm_visible_count[w];
+  for(int m=m0;m<m1;m++)
+    if (!HIDDEN(job->hide, perm[m])) *out++ = perm[m];
+}
+
+// Bring the visible lists up to date with hide
+void visible_update(uint64_t * hide, int num_data)
+{
+  if (visible_valid) return;
+  struct visible_job job = {hide, num_data};
+  pool_run(visible_count_job, &job);
+  int pos = 0, perm_pos = 0;
+  for(int w=0;w<num_workers;w++)
+    {
+      int n = visible_count[w];
+      visible_count[w] = pos;
+      pos += n;
+      n = perm_visible_count[w];
+      perm_visible_count[w] = perm_pos;
+      perm_pos += n;
+    }
+  pool_run(visible_scatter_job, &job);
+  num_visible = pos;
+  visible_valid = 1;
+}
+
+// Drop the visible lists if any of the m logged edits changed the
+// visibility of its point (entries hold the state before the edit)
+void visible_patch(uint64_t * hide, struct undo_entry * entry, size_t m)
+{
+  for(size_t j=0;j<m && visible_valid;j++)
+    if (entry[j].hide != (int32_t) HIDDEN(hide, entry[j].index))
+      visible_valid = 0;
+}
+
+// SDL upload of pnt[i] without presenting
+void upload(int i)
+{
+  SDL_UpdateTexture(texture[i], NULL, pnt[i], SCREEN_WIDTH[i] * sizeof(unsigned));
+  SDL_RenderCopy(renderer[i], texture[i], NULL, NULL);
+}
+
 // SDL refresh
 void refresh(int i)
 {
-  SDL_UpdateTexture(texture[i], NULL, pnt[i], SCREEN_WIDTH[i] * sizeof(unsigned));
   SDL_RenderClear(renderer[i]);
-  SDL_RenderCopy(renderer[i], texture[i], NULL, NULL);
+  upload(i);
   SDL_RenderPresent(renderer[i]);
 }
 
@@ -268,18 +716,24 @@ void screen_init(int i, int init, char * name, int xpos, int ypos)
 
       SDL_RendererInfo info;
       SDL_GetRendererInfo(renderer[i], &info);
+      // No GPU, so the per-point copies are slow; splat on the CPU instead.
+      if (i == POINT_SCREEN && !(info.flags & SDL_RENDERER_ACCELERATED))
+	render_mode = RENDER_MODE_SOFTWARE;
     }
   SDL_RenderClear(renderer[i]);
   SDL_GL_SwapWindow(screen[i]);
   texture[i] = SDL_CreateTexture(renderer[i],SDL_PIXELFORMAT_ARGB8888,
 			      SDL_TEXTUREACCESS_STREAMING,
 			      SCREEN_WIDTH[i], SCREEN_HEIGHT[i]);
+  // Software splats are added on top of the histograms already drawn.
+  if (i == POINT_SCREEN) SDL_SetTextureBlendMode(texture[i], SDL_BLENDMODE_ADD);
   SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY,
   	      "linear");  // make the scaled rendering look smoother.
   SDL_RenderSetLogicalSize(renderer[i], SCREEN_WIDTH[i], SCREEN_HEIGHT[i]);
 
   if (pnt[i]) free(pnt[i]);
   if ((pnt[i] = malloc(SCREEN_WIDTH[i] * SCREEN_HEIGHT[i] * sizeof(unsigned))) == 0) ERROR("OUT OF MEMORY");
+  if (i == POINT_SCREEN) hdr_valid = density_valid = 0;
 }
 
 void blt(SDL_Surface * surface, int screen_index, int x, int y,
@@ -317,187 +771,803 @@ unsigned get_color(unsigned color_value)
     return COLOR_HASH(color_value, brush_color_mode);
 }
 
-// The global transformation to point window coordinates (define by A)
-void transform(double * data_point, double * out_x, double * out_y)
-{
-  double x = 0.0;
-  double y = 0.0;
-  for(int j=0; j < dim; j++)
-    {
-      x += A[AA(j,0)] * data_point[j];
-      y += A[AA(j,1)] * data_point[j];
-    }
-  double x0 = SCREEN_WIDTH[POINT_SCREEN]/2.0;
-  double y0 = SCREEN_HEIGHT[POINT_SCREEN]/2.0;
-  double xs = x * POINT_ZOOM * zoom_ratio + x0;
-  double ys = y * POINT_ZOOM * zoom_ratio + y0;
-
-  // Use clipped points
-  if (xs < 0) xs = 0.0;
-  if (ys < 0) ys = 0.0;
-  if (xs >= SCREEN_WIDTH[POINT_SCREEN]) xs = SCREEN_WIDTH[POINT_SCREEN] - 1;
-  if (ys >= SCREEN_HEIGHT[POINT_SCREEN]) ys = SCREEN_HEIGHT[POINT_SCREEN] - 1;
-
-  *out_x = xs;
-  *out_y = ys;
-}
-
-void xy_transform(double * data_point, double * out_x, double * out_y,
-		  int i, int j, int * xy_dim, int xy_cnt)
-{
-  double x0 = (j + 0.5) * SCREEN_WIDTH[POINT_SCREEN] / xy_cnt;
-  double y0 = (i + 0.5) * SCREEN_HEIGHT[POINT_SCREEN] / xy_cnt;
-  double dx = data_point[xy_dim[i]];
-  double dy = data_point[xy_dim[j]];
-  dx *= POINT_ZOOM * zoom_ratio;
-  dy *= POINT_ZOOM * zoom_ratio;
-  dx /= xy_cnt;
-  dy /= xy_cnt;
-  if (dx < -0.5 * SCREEN_WIDTH[POINT_SCREEN] / xy_cnt)
-    dx = -0.5 * SCREEN_WIDTH[POINT_SCREEN] / xy_cnt;
-  if (dy < -0.5 * SCREEN_WIDTH[POINT_SCREEN] / xy_cnt)
-    dy = -0.5 * SCREEN_WIDTH[POINT_SCREEN] / xy_cnt;
-  if (dx > 0.5 * SCREEN_WIDTH[POINT_SCREEN] / xy_cnt)
-    dx = 0.5 * SCREEN_WIDTH[POINT_SCREEN] / xy_cnt;
-  if (dy > 0.5 * SCREEN_WIDTH[POINT_SCREEN] / xy_cnt)
-    dy = 0.5 * SCREEN_WIDTH[POINT_SCREEN] / xy_cnt;
-  
-  *out_x = y0 + dx;
-  *out_y = x0 + dy;
+void set_gamma()
+{
+  for(int i=0;i<256;i++) gamma_map[i] = 256 * pow(i/256.0, gamma_correct);
 }
 
+static inline uint32_t gamma_rgb(unsigned c)
+{
+  return (gamma_map[(c>>16) & 0xff] << 16) | (gamma_map[(c>>8) & 0xff] << 8)
+    | gamma_map[(c>>0) & 0xff];
+}
 
-// Draws one of the sliders onto the control window.
-void draw_slider(double log_ratio, double ratio, double grove_width,
-		 double grove_height, double grove_x, double grove_y,
-		 double slider_width, double slider_height,
-		 unsigned grove_color, unsigned slider_color)
+// Gamma is left to the tone map in HDR mode
+static inline uint32_t display_map(unsigned c)
 {
-  int slider_y = (log_ratio * log2(ratio)) + grove_height / 2.0;
-  if (slider_y < 0) slider_y = 0;
-  if (slider_y >= grove_height) slider_y = grove_height - 1;
-  for(int y = grove_y; y < grove_y + grove_height; y++)
-    for(int x = grove_x; x < grove_x + grove_width; x++)
-      point(CONTROL_SCREEN, x + CONTROL_NUMBER_X, y) = grove_color;
-  for(int dy = -slider_height/2; dy <= slider_height/2; dy++)
-    for(int dx = -slider_width/2; dx <= slider_width/2; dx++)
-      point(CONTROL_SCREEN, CONTROL_NUMBER_X + grove_x + grove_width/2 + dx,
-	    grove_y + dy + slider_y) = slider_color;
+  return hdr_on ? c : gamma_rgb(c);
 }
 
-void blt_text(int screen_number, SDL_Surface * the_text, int x, int y,
-	      unsigned color)
+void display_range(int w, int k0, int k1, void * arg)
 {
-  for(int dx=0;dx<the_text->w;dx++)
-    for(int dy=0;dy<the_text->h;dy++)
-      {
-	uint8_t c = * (uint8_t *) ((uint8_t *) the_text->pixels
-				   + dy * the_text->pitch
-				   + dx * the_text->format->BytesPerPixel);
-	if (c)
-	  {
-	    int xx = x + dx;
-	    int yy = y + dy;
-	    if (xx>=0 && yy>=0 && xx < SCREEN_WIDTH[screen_number]
-		&& yy < SCREEN_HEIGHT[screen_number])
-	      point(screen_number, xx, yy) = color;
-	  }
-      }
+  int32_t * color = arg;
+  if (brush_color_mode == BRUSH_COLOR_MODE_DIRECT)
+    {
+      uint32_t rgb[8];
+      for(int c=0;c<8;c++) rgb[c] = display_map(brush_color[c]);
+      for(int k=k0;k<k1;k++)
+	display_color[k] = rgb[(color[k] >> mask_location) & 7];
+    }
+  else
+    for(int k=k0;k<k1;k++) display_color[k] = display_map(get_color(color[k]));
 }
 
-// Draws the control window
-void draw_controls()
+// Recompute the display colors if the color mode, mask or gamma moved
+void display_update(int32_t * color, int num_data)
 {
-  // Background fill
-  for(int y=0; y<SCREEN_HEIGHT[1]; y++)
-    for(int x=0; x<SCREEN_WIDTH[1]; x++)
-      point(CONTROL_SCREEN,x,y) = CONTROL_BG_COLOR;
+  double gamma = hdr_on ? -1.0 : gamma_correct;
+  if (display_mode == brush_color_mode && display_mask == mask_location
+      && display_gamma == gamma) return;
+  display_mode = brush_color_mode;
+  display_mask = mask_location;
+  display_gamma = gamma;
+  pool_for(num_data, display_range, color);
+}
 
-  // Main controls
-  for(int i = 0; i < dim; i++)
+// Forget the display colors, e.g. for a new label array
+void display_invalidate()
+{
+  display_mode = -1;
+}
+
+// The high bits of the product, which depend on all bits of the label
+// (labels that are multiples of the capacity share their low bits)
+static inline unsigned color_table_hash(int32_t label)
+{
+  return ((uint32_t) label * 2654435761u) >> color_table_shift;
+}
+
+struct color_entry * color_table_find(int32_t label)
+{
+  unsigned i = color_table_hash(label);
+  while (color_table[i].count >= 0 && color_table[i].label != label)
+    i = (i + 1) & (color_table_capacity - 1);
+  if (color_table[i].count < 0)
     {
-      // Text
-      int number = i % MAX_TEXT_NUMBER;
-      blt_text(CONTROL_SCREEN, text[number], CONTROL_NUMBER_XLOC,
-	       CONTROL_NUMBER_YLOC + i*CONTROL_Y_STEP - control_scroll, 0xa0a0a0);
-      
-      // Circle displays
-      for(int y=0;y<2*CONTROL_RADIUS;y++)
+      if (2 * (color_table_used + 1) > color_table_capacity)
 	{
-	  int yy = y + i*CONTROL_Y_STEP - control_scroll;
-	  if (yy < 0 || yy >= SCREEN_HEIGHT[CONTROL_SCREEN]) continue;
-	  int y0 = y - CONTROL_RADIUS;
-	  for(int x=0;x<2*CONTROL_RADIUS;x++)
-	    {
-	      int xx = x + CONTROL_NUMBER_X;   	 
-	      int x0 = x - CONTROL_RADIUS;
-	      if (SQR(x0) + SQR(y0) <= SQR(CONTROL_RADIUS))
-		{
-		  if (xx < 0 || xx >= SCREEN_WIDTH[CONTROL_SCREEN]) continue;
-		  point(CONTROL_SCREEN, xx, yy) = CONTROL_FG_COLOR;
-		}
-	    }
+	  // Grow, rehashing every slot
+	  struct color_entry * old = color_table;
+	  int old_capacity = color_table_capacity;
+	  color_table_capacity *= 2;
+	  color_table_shift--;
+	  color_table_used = 0;
+	  if ((color_table = malloc(color_table_capacity *
+				    sizeof(struct color_entry))) == NULL)
+	    {fprintf(stderr, "Out of memory\n");exit(1);}
+	  for(int j=0;j<color_table_capacity;j++) color_table[j].count = -1;
+	  for(int j=0;j<old_capacity;j++)
+	    if (old[j].count >= 0) *color_table_find(old[j].label) = old[j];
+	  free(old);
+	  return color_table_find(label);
 	}
-      double dx = CONTROL_RADIUS * A[AA(i,0)];
-      double dy = CONTROL_RADIUS * A[AA(i,1)];
-      for(double r=0.0; r<1.0; r+=CONTROL_LINE_STEP)
+      color_table[i] = (struct color_entry) {label, 0, 0};
+      color_table_used++;
+    }
+  return &color_table[i];
+}
+
+// One more (or, with delta -1, one less) point with this label and hide
+static inline void color_table_add(int32_t label, int hidden, int delta)
+{
+  struct color_entry * e = color_table_find(label);
+  e->count += delta;
+  if (hidden) e->hidden += delta;
+}
+
+// Count every point
+void color_table_build(int32_t * color, uint64_t * hide, int num_data)
+{
+  free(color_table);
+  color_table_capacity = 64;
+  color_table_shift = 26;
+  color_table_used = 0;
+  if ((color_table = malloc(color_table_capacity *
+			    sizeof(struct color_entry))) == NULL)
+    {fprintf(stderr, "Out of memory\n");exit(1);}
+  for(int j=0;j<color_table_capacity;j++) color_table[j].count = -1;
+  struct color_entry * e = NULL;
+  for(int i=0;i<num_data;i++)
+    {
+      if (e == NULL || e->label != color[i])
+	e = color_table_find(color[i]);
+      e->count++;
+      e->hidden += HIDDEN(hide, i);
+    }
+}
+
+// Logged edits, each point at most once: old values are in the log, new
+// values in color/hide
+void color_table_log(struct undo_entry * entry, size_t m, int32_t * color,
+		     uint64_t * hide)
+{
+  for(size_t j=0;j<m;j++)
+    {
+      int k = entry[j].index;
+      int h = HIDDEN(hide, k);
+      if (color[k] == entry[j].color && h == entry[j].hide) continue;
+      color_table_add(entry[j].color, entry[j].hide, -1);
+      color_table_add(color[k], h, 1);
+    }
+}
+
+// OR of every label in use
+unsigned color_table_mask()
+{
+  unsigned mask = 0;
+  for(int j=0;j<color_table_capacity;j++)
+    if (color_table[j].count > 0) mask |= color_table[j].label;
+  return mask;
+}
+
+// Largest label in use
+int32_t color_table_max()
+{
+  int32_t max_label = 0;
+  for(int j=0;j<color_table_capacity;j++)
+    if (color_table[j].count > 0 && color_table[j].label > max_label)
+      max_label = color_table[j].label;
+  return max_label;
+}
+
+int cmp_pie_slice(const void * p1, const void * p2)
+{
+  const struct pie_slice * s1 = p1;
+  const struct pie_slice * s2 = p2;
+  if (s1->rgb != s2->rgb) return s1->rgb < s2->rgb ? -1 : 1;
+  if ((uint32_t) s1->label != (uint32_t) s2->label)
+    return (uint32_t) s1->label < (uint32_t) s2->label ? -1 : 1;
+  return 0;
+}
+
+// Fill slice (malloced by the caller, color_table_used long) in pie order,
+// returns the number of slices. Each display color group lists its visible
+// points before its hidden ones.
+int pie_slices(struct pie_slice * slice)
+{
+  int n = 0;
+  for(int j=0;j<color_table_capacity;j++)
+    {
+      if (color_table[j].count <= 0) continue;
+      slice[n].rgb = get_color(color_table[j].label);
+      slice[n].label = color_table[j].label;
+      slice[n].count = color_table[j].count;
+      // Stash the hidden count until the groups are known
+      slice[n].group_visible_end = color_table[j].hidden;
+      n++;
+    }
+  qsort(slice, n, sizeof(struct pie_slice), &cmp_pie_slice);
+  int start = 0;
+  for(int g=0;g<n;)
+    {
+      int h = g;
+      int hidden = 0;
+      for(;h<n && slice[h].rgb == slice[g].rgb;h++)
 	{
-	  for(int dx2=-CONTROL_ARROW_THICKNESS;dx2<=CONTROL_ARROW_THICKNESS;dx2++)
-	    {
-	      int xx =CONTROL_NUMBER_X + dx2 + (int)(CONTROL_RADIUS+dx*r);
-	      if (xx <= 0 || xx >= SCREEN_WIDTH[CONTROL_SCREEN]) continue;
-	      for(int dy2=-CONTROL_ARROW_THICKNESS;dy2<=CONTROL_ARROW_THICKNESS;
-		  dy2++)
-		{  		 
-		  int yy = dy2 + (int)(i*CONTROL_Y_STEP+CONTROL_RADIUS+dy*r)
-		    - control_scroll;
-		  if (yy <= 0 || yy >= SCREEN_HEIGHT[CONTROL_SCREEN]) continue;
-		  point(CONTROL_SCREEN, xx, yy) = CONTROL_ARROW_COLOR;
-		}
-	    }
+	  slice[h].start = start;
+	  start += slice[h].count;
+	  hidden += slice[h].group_visible_end;
 	}
-      
-      // Boxes
-      SDL_Surface * box_text[4] = {text_x, text_y, text_r, text_xy};
-      for(int bi = 0; bi < CONTROL_NUM_BOX; bi++)
+      for(int i=g;i<h;i++)
 	{
-	  for(int y=-CONTROL_BOX_RADIUS;y<=CONTROL_BOX_RADIUS;y++)
-	    {
-	      int yy = y+i*CONTROL_Y_STEP + CONTROL_RADIUS - control_scroll;
-	      if (yy < 0 || yy >= SCREEN_HEIGHT[CONTROL_SCREEN]) continue;
-	      for(int x=-CONTROL_BOX_RADIUS;x<=CONTROL_BOX_RADIUS;x++)
-		{
-		  int xx = CONTROL_NUMBER_X +
-		    x+CONTROL_Y_STEP*(bi+CONTROL_BOX_SHIFT) + CONTROL_RADIUS;
-		  if (xx < 0 || xx >= SCREEN_WIDTH[CONTROL_SCREEN]) continue;
-		  int color;
-		  if (y==-CONTROL_BOX_RADIUS || x==-CONTROL_BOX_RADIUS || \
-		      y==CONTROL_BOX_RADIUS || x==CONTROL_BOX_RADIUS)
-		    color = CONTROL_BOX_FG;
-		  else
-		    color = box[i][bi] ? CONTROL_BOX_SELECT : CONTROL_BOX_BG;
-		  point(CONTROL_SCREEN, xx, yy) = color;
-		}
-	    }
-	  int x = 27+CONTROL_NUMBER_X + CONTROL_Y_STEP*(bi+CONTROL_BOX_SHIFT);
-	  int y = i*CONTROL_Y_STEP + CONTROL_RADIUS - control_scroll - 13;
-	  if (bi == 3) x-=12;
-	  blt_text(CONTROL_SCREEN, box_text[bi], x, y, 0x900000);
+	  slice[i].group_end = start;
+	  slice[i].group_visible_end = start - hidden;
 	}
+      g = h;
     }
+  return n;
+}
+
+// The slice holding rank r (0 <= r < total count)
+struct pie_slice * pie_find(struct pie_slice * slice, int n, int r)
+{
+  int lo = 0, hi = n - 1;
+  while (lo < hi)
+    {
+      int mid = (lo + hi + 1) / 2;
+      if (slice[mid].start <= r) lo = mid;
+      else hi = mid - 1;
+    }
+  return &slice[lo];
+}
+
+// Gather the active rows of A
+void active_update()
+{
+  if (active_valid) return;
+  active_cnt = 0;
+  for(int j=0;j<dim;j++)
+    {
+      if (A[AF(j,0)] == 0.0 && A[AF(j,1)] == 0.0) continue;
+      active_dim[active_cnt] = j;
+      active_a0[active_cnt] = A[AF(j,0)];
+      active_a1[active_cnt] = A[AF(j,1)];
+      active_cnt++;
+    }
+  active_valid = 1;
+}
+
+// Project points [k0,k1) reading only the n active columns of data.
+// Inlined with a constant n this unrolls completely.
+static inline __attribute__((always_inline))
+void proj_gather(int n, int k0, int k1, double (*data)[dim],
+		 double * out_x, double * out_y)
+{
+  for(int k=k0;k<k1;k++)
+    {
+      double x = 0.0;
+      double y = 0.0;
+      for(int a=0;a<n;a++)
+	{
+	  double v = data[k][active_dim[a]];
+	  x += active_a0[a] * v;
+	  y += active_a1[a] * v;
+	}
+      out_x[k] = x;
+      out_y[k] = y;
+    }
+}
+
+// Sparse projection kernel, specialised for 2-8 active rows
+void proj_sparse(int k0, int k1, double (*data)[dim],
+		 double * out_x, double * out_y)
+{
+  switch(active_cnt)
+    {
+    case 2: proj_gather(2, k0, k1, data, out_x, out_y); break;
+    case 3: proj_gather(3, k0, k1, data, out_x, out_y); break;
+    case 4: proj_gather(4, k0, k1, data, out_x, out_y); break;
+    case 5: proj_gather(5, k0, k1, data, out_x, out_y); break;
+    case 6: proj_gather(6, k0, k1, data, out_x, out_y); break;
+    case 7: proj_gather(7, k0, k1, data, out_x, out_y); break;
+    case 8: proj_gather(8, k0, k1, data, out_x, out_y); break;
+    default: proj_gather(active_cnt, k0, k1, data, out_x, out_y); break;
+    }
+}
+
+// Dense projection kernels (all rows active, so active_a0/1 are A's columns)
+void proj_dense_scalar(int k0, int k1, double (*data)[dim],
+		       double * out_x, double * out_y)
+{
+  for(int k=k0;k<k1;k++)
+    {
+      double x = 0.0;
+      double y = 0.0;
+      for(int j=0;j<dim;j++)
+	{
+	  x += active_a0[j] * data[k][j];
+	  y += active_a1[j] * data[k][j];
+	}
+      out_x[k] = x;
+      out_y[k] = y;
+    }
+}
+
+#ifdef __SSE2__
+// 2 points at a time, 2 dims per step
+void proj_dense_sse2(int k0, int k1, double (*data)[dim],
+		     double * out_x, double * out_y)
+{
+  int d2 = dim & ~1;
+  int k = k0;
+  for(;k + 2 <= k1;k += 2)
+    {
+      __m128d x0 = _mm_setzero_pd();
+      __m128d x1 = _mm_setzero_pd();
+      __m128d y0 = _mm_setzero_pd();
+      __m128d y1 = _mm_setzero_pd();
+      for(int j=0;j<d2;j+=2)
+	{
+	  __m128d a0 = _mm_loadu_pd(&active_a0[j]);
+	  __m128d a1 = _mm_loadu_pd(&active_a1[j]);
+	  __m128d v0 = _mm_loadu_pd(&data[k][j]);
+	  __m128d v1 = _mm_loadu_pd(&data[k+1][j]);
+	  x0 = _mm_add_pd(x0, _mm_mul_pd(v0, a0));
+	  y0 = _mm_add_pd(y0, _mm_mul_pd(v0, a1));
+	  x1 = _mm_add_pd(x1, _mm_mul_pd(v1, a0));
+	  y1 = _mm_add_pd(y1, _mm_mul_pd(v1, a1));
+	}
+      __m128d x = _mm_add_pd(_mm_unpacklo_pd(x0, x1), _mm_unpackhi_pd(x0, x1));
+      __m128d y = _mm_add_pd(_mm_unpacklo_pd(y0, y1), _mm_unpackhi_pd(y0, y1));
+      _mm_storeu_pd(&out_x[k], x);
+      _mm_storeu_pd(&out_y[k], y);
+      for(int j=d2;j<dim;j++)
+	for(int p=0;p<2;p++)
+	  {
+	    out_x[k+p] += active_a0[j] * data[k+p][j];
+	    out_y[k+p] += active_a1[j] * data[k+p][j];
+	  }
+    }
+  proj_dense_scalar(k, k1, data, out_x, out_y);
+}
+
+// Sums of each of a, b, c, d
+__attribute__((target("avx2,fma")))
+static inline __m256d hsum4_pd(__m256d a, __m256d b, __m256d c, __m256d d)
+{
+  __m256d ab = _mm256_hadd_pd(a, b);
+  __m256d cd = _mm256_hadd_pd(c, d);
+  return _mm256_add_pd(_mm256_permute2f128_pd(ab, cd, 0x20),
+		       _mm256_permute2f128_pd(ab, cd, 0x31));
+}
+
+// 4 points at a time, 4 dims per step, so each column load feeds 4 FMAs
+__attribute__((target("avx2,fma")))
+void proj_dense_avx2(int k0, int k1, double (*data)[dim],
+		     double * out_x, double * out_y)
+{
+  int d4 = dim & ~3;
+  int k = k0;
+  for(;k + 4 <= k1;k += 4)
+    {
+      __m256d x0 = _mm256_setzero_pd();
+      __m256d x1 = _mm256_setzero_pd();
+      __m256d x2 = _mm256_setzero_pd();
+      __m256d x3 = _mm256_setzero_pd();
+      __m256d y0 = _mm256_setzero_pd();
+      __m256d y1 = _mm256_setzero_pd();
+      __m256d y2 = _mm256_setzero_pd();
+      __m256d y3 = _mm256_setzero_pd();
+      for(int j=0;j<d4;j+=4)
+	{
+	  __m256d a0 = _mm256_loadu_pd(&active_a0[j]);
+	  __m256d a1 = _mm256_loadu_pd(&active_a1[j]);
+	  __m256d v0 = _mm256_loadu_pd(&data[k][j]);
+	  __m256d v1 = _mm256_loadu_pd(&data[k+1][j]);
+	  __m256d v2 = _mm256_loadu_pd(&data[k+2][j]);
+	  __m256d v3 = _mm256_loadu_pd(&data[k+3][j]);
+	  x0 = _mm256_fmadd_pd(v0, a0, x0);
+	  y0 = _mm256_fmadd_pd(v0, a1, y0);
+	  x1 = _mm256_fmadd_pd(v1, a0, x1);
+	  y1 = _mm256_fmadd_pd(v1, a1, y1);
+	  x2 = _mm256_fmadd_pd(v2, a0, x2);
+	  y2 = _mm256_fmadd_pd(v2, a1, y2);
+	  x3 = _mm256_fmadd_pd(v3, a0, x3);
+	  y3 = _mm256_fmadd_pd(v3, a1, y3);
+	}
+      _mm256_storeu_pd(&out_x[k], hsum4_pd(x0, x1, x2, x3));
+      _mm256_storeu_pd(&out_y[k], hsum4_pd(y0, y1, y2, y3));
+      for(int j=d4;j<dim;j++)
+	for(int p=0;p<4;p++)
+	  {
+	    out_x[k+p] += active_a0[j] * data[k+p][j];
+	    out_y[k+p] += active_a1[j] * data[k+p][j];
+	  }
+    }
+  proj_dense_scalar(k, k1, data, out_x, out_y);
+}
+#endif
+
+void (*proj_dense)(int k0, int k1, double (*data)[dim],
+		   double * out_x, double * out_y) = proj_dense_scalar;
+
+// A changed arbitrarily, recompute the projection cache on next use
+void proj_invalidate()
+{
+  proj_valid = 0;
+  proj_pending = 0;
+  active_valid = 0;
+}
+
+// A was just rotated by theta in the dim1/dim2 plane
+void proj_rotate_pair(int dim1, int dim2, double theta)
+{
+  if (!proj_valid) return;
+  if (proj_pending && (proj_dim1 != dim1 || proj_dim2 != dim2))
+    {
+      proj_invalidate();
+      return;
+    }
+  if (!proj_pending) proj_theta = 0.0;
+  proj_pending = 1;
+  proj_dim1 = dim1;
+  proj_dim2 = dim2;
+  proj_theta += theta;
+}
+
+// Arguments of the projection jobs
+struct proj_job
+{
+  double * data;
+  double d1[2];
+  double d2[2];
+};
+
+void proj_patch_range(int w, int k0, int k1, void * arg)
+{
+  struct proj_job * job = arg;
+  double (*data)[dim] = (double (*)[dim]) job->data;
+  for(int k=k0;k<k1;k++)
+    {
+      double v1 = data[k][proj_dim1];
+      double v2 = data[k][proj_dim2];
+      proj_x[k] += job->d1[0] * v1 + job->d2[0] * v2;
+      proj_y[k] += job->d1[1] * v1 + job->d2[1] * v2;
+    }
+}
+
+void proj_full_range(int w, int k0, int k1, void * arg)
+{
+  struct proj_job * job = arg;
+  double (*data)[dim] = (double (*)[dim]) job->data;
+  if (active_cnt < dim)
+    proj_sparse(k0, k1, data, proj_x, proj_y);
+  else
+    proj_dense(k0, k1, data, proj_x, proj_y);
+}
+
+// Bring the projection cache up to date with A
+void proj_update(int num_data, double (*data)[dim])
+{
+  struct proj_job job = {(double *) data};
+  if (proj_valid && proj_pending && proj_patches < PROJ_MAX_PATCHES)
+    {
+      // Rows dim1/dim2 of A before the pending rotation
+      double c = cos(proj_theta);
+      double s = sin(proj_theta);
+      for(int m=0;m<2;m++)
+	{
+	  double a1 = A[AF(proj_dim1,m)];
+	  double a2 = A[AF(proj_dim2,m)];
+	  job.d1[m] = a1 - (c * a1 + s * a2);
+	  job.d2[m] = a2 - (-s * a1 + c * a2);
+	}
+      pool_for(num_data, proj_patch_range, &job);
+      proj_pending = 0;
+      proj_patches++;
+      proj_version++;
+      return;
+    }
+  if (proj_valid && !proj_pending) return;
+
+  active_update();
+  pool_for(num_data, proj_full_range, &job);
+  proj_version++;
+  proj_valid = 1;
+  proj_pending = 0;
+  proj_patches = 0;
+}
+
+// Zoom, offset and clamp the projection cache into screen coordinates
+void proj_screen_range(int w, int k0, int k1, void * arg)
+{
+  float scale = POINT_ZOOM * zoom_ratio;
+  float x0 = SCREEN_WIDTH[POINT_SCREEN]/2.0;
+  float y0 = SCREEN_HEIGHT[POINT_SCREEN]/2.0;
+  float x_max = SCREEN_WIDTH[POINT_SCREEN] - 1;
+  float y_max = SCREEN_HEIGHT[POINT_SCREEN] - 1;
+  for(int k=k0;k<k1;k++)
+    {
+      float xs = proj_x[k] * scale + x0;
+      float ys = proj_y[k] * scale + y0;
+      xs = xs < 0.0f ? 0.0f : xs;
+      ys = ys < 0.0f ? 0.0f : ys;
+      screen_x[k] = xs > x_max ? x_max : xs;
+      screen_y[k] = ys > y_max ? y_max : ys;
+    }
+}
+
+// The projection stage: screen_x/screen_y for the current A and zoom
+void proj_stage(int num_data, double (*data)[dim])
+{
+  proj_update(num_data, data);
+  if (screen_version == proj_version && screen_zoom == zoom_ratio) return;
+  pool_for(num_data, proj_screen_range, NULL);
+  screen_version = proj_version;
+  screen_zoom = zoom_ratio;
+}
+
+// Arguments of the x/y matrix job
+struct xy_job
+{
+  double * data;
+  int num_data;
+};
+
+// One column per selected dim: the value times POINT_ZOOM * zoom_ratio / cnt,
+// clamped to half a cell, as a float offset from the cell centre. A point's
+// screen coordinate in a cell is (float) (centre + column).
+void xy_col_range(int w, int k0, int k1, void * arg)
+{
+  struct xy_job * job = arg;
+  double (*data)[dim] = (double (*)[dim]) job->data;
+  int cnt = xy_col_cnt;
+  double scale = POINT_ZOOM * zoom_ratio / cnt;
+  double lim = 0.5 * SCREEN_WIDTH[POINT_SCREEN] / cnt;
+  double x0[cnt], y0[cnt];
+  for(int i=0;i<cnt;i++)
+    {
+      x0[i] = (i + 0.5) * SCREEN_HEIGHT[POINT_SCREEN] / cnt;
+      y0[i] = (i + 0.5) * SCREEN_WIDTH[POINT_SCREEN] / cnt;
+    }
+  for(int k=k0;k<k1;k++)
+    {
+      int16_t (*pixel)[2] = xy_pixel + (size_t) k * cnt;
+      for(int i=0;i<cnt;i++)
+	{
+	  double u = data[k][xy_col_dim[i]] * scale;
+	  if (u < -lim) u = -lim;
+	  if (u > lim) u = lim;
+	  float col = u;
+	  xy_col[(size_t) i * job->num_data + k] = col;
+	  pixel[i][0] = (float) (x0[i] + col);
+	  pixel[i][1] = (float) (y0[i] + col);
+	}
+    }
+}
+
+// The x/y matrix stage: xy_col for the selected dims and zoom
+void xy_stage(int num_data, double (*data)[dim], int * xy_dim, int xy_cnt)
+{
+  int same = (xy_cnt == xy_col_cnt && zoom_ratio == xy_col_zoom);
+  for(int i=0;same && i<xy_cnt;i++) same = (xy_dim[i] == xy_col_dim[i]);
+  if (same) return;
+  if (xy_cnt > xy_col_capacity)
+    {
+      free(xy_col);
+      free(xy_pixel);
+      if ((xy_col = malloc((size_t) xy_cnt * num_data * sizeof(float))) == NULL)
+	{fprintf(stderr, "Out of memory\n");exit(1);}
+      if ((xy_pixel = malloc((size_t) xy_cnt * num_data * sizeof(*xy_pixel)))
+	  == NULL)
+	{fprintf(stderr, "Out of memory\n");exit(1);}
+      xy_col_capacity = xy_cnt;
+    }
+  for(int i=0;i<xy_cnt;i++) xy_col_dim[i] = xy_dim[i];
+  xy_col_cnt = xy_cnt;
+  xy_col_zoom = zoom_ratio;
+  xy_col_version++;
+  struct xy_job job = {(double *) data, num_data};
+  pool_for(num_data, xy_col_range, &job);
+}
+
+// Arguments of the grid jobs
+struct grid_job
+{
+  int num_data;
+};
+
+static inline int grid_cell(int k)
+{
+  return ((int) (float) (grid_oy + grid_py[k]) >> GRID_SHIFT) * grid_w
+    + ((int) (float) (grid_ox + grid_px[k]) >> GRID_SHIFT);
+}
+
+// Counting sort pass 1, cell counts for this worker's share of the points
+void grid_count_job(int w, void * arg)
+{
+  struct grid_job * job = arg;
+  int * count = grid_count + (size_t) w * grid_w * grid_h;
+  int k0 = (int64_t) job->num_data * w / num_workers;
+  int k1 = (int64_t) job->num_data * (w + 1) / num_workers;
+  memset(count, 0, grid_w * grid_h * sizeof(int));
+  for(int k=k0;k<k1;k++) count[grid_cell(k)]++;
+}
+
+// Counting sort pass 2, scatter this worker's share into its slots
+void grid_scatter_job(int w, void * arg)
+{
+  struct grid_job * job = arg;
+  int * count = grid_count + (size_t) w * grid_w * grid_h;
+  int k0 = (int64_t) job->num_data * w / num_workers;
+  int k1 = (int64_t) job->num_data * (w + 1) / num_workers;
+  for(int k=k0;k<k1;k++) grid_index[count[grid_cell(k)]++] = k;
+}
+
+// Bring the bucket grid up to date with the points at (ox + px, oy + py)
+void grid_update(int num_data, float * px, float * py, double ox, double oy,
+		 unsigned version, double zoom)
+{
+  if (px == grid_px && py == grid_py && ox == grid_ox && oy == grid_oy
+      && version == grid_version && zoom == grid_zoom) return;
+  grid_px = px;
+  grid_py = py;
+  grid_ox = ox;
+  grid_oy = oy;
+  int cells = grid_w * grid_h;
+  struct grid_job job = {num_data};
+  pool_run(grid_count_job, &job);
+  int pos = 0;
+  for(int c=0;c<cells;c++)
+    {
+      grid_start[c] = pos;
+      for(int w=0;w<num_workers;w++)
+	{
+	  int n = grid_count[(size_t) w * cells + c];
+	  grid_count[(size_t) w * cells + c] = pos;
+	  pos += n;
+	}
+    }
+  grid_start[cells] = pos;
+  pool_run(grid_scatter_job, &job);
+  grid_version = version;
+  grid_zoom = zoom;
+}
+
+// Nearest visible grid point to (x, y), lowest index on ties, -1 if none.
+// Searches rings of cells outwards until no closer point can remain.
+int grid_nearest(double x, double y, uint64_t * hide)
+{
+  int cx = (int) x >> GRID_SHIFT;
+  int cy = (int) y >> GRID_SHIFT;
+  cx = cx < 0 ? 0 : (cx >= grid_w ? grid_w - 1 : cx);
+  cy = cy < 0 ? 0 : (cy >= grid_h ? grid_h - 1 : cy);
+  double best_dist_sqr = INFINITY;
+  int best = -1;
+  int r_max = grid_w > grid_h ? grid_w : grid_h;
+  for(int r=0;r<=r_max;r++)
+    {
+      double near = (double) ((r - 1) << GRID_SHIFT);
+      if (r > 1 && SQR(near) > best_dist_sqr) break;
+      for(int gy=cy-r;gy<=cy+r;gy++)
+	{
+	  if (gy < 0 || gy >= grid_h) continue;
+	  // Whole rows at the top and bottom of the ring, just the ends otherwise
+	  int step = (gy == cy - r || gy == cy + r) ? 1 : 2 * r;
+	  for(int gx=cx-r;gx<=cx+r;gx+=step)
+	    {
+	      if (gx < 0 || gx >= grid_w) continue;
+	      int c = gy * grid_w + gx;
+	      for(int m=grid_start[c];m<grid_start[c+1];m++)
+		{
+		  int k = grid_index[m];
+		  if (HIDDEN(hide, k)) continue;
+		  double dist_sqr = SQR((float) (grid_ox + grid_px[k]) - x) +
+		    SQR((float) (grid_oy + grid_py[k]) - y);
+		  if (dist_sqr < best_dist_sqr ||
+		      (dist_sqr == best_dist_sqr && k < best))
+		    {
+		      best_dist_sqr = dist_sqr;
+		      best = k;
+		    }
+		}
+	    }
+	}
+    }
+  return best;
+}
+
+// Draws one of the sliders onto the control window.
+void draw_slider(double log_ratio, double ratio, double grove_width,
+		 double grove_height, double grove_x, double grove_y,
+		 double slider_width, double slider_height,
+		 unsigned grove_color, unsigned slider_color)
+{
+  int slider_y = (log_ratio * log2(ratio)) + grove_height / 2.0;
+  if (slider_y < 0) slider_y = 0;
+  if (slider_y >= grove_height) slider_y = grove_height - 1;
+  for(int y = grove_y; y < grove_y + grove_height; y++)
+    for(int x = grove_x; x < grove_x + grove_width; x++)
+      point(CONTROL_SCREEN, x + CONTROL_NUMBER_X, y) = grove_color;
+  for(int dy = -slider_height/2; dy <= slider_height/2; dy++)
+    for(int dx = -slider_width/2; dx <= slider_width/2; dx++)
+      point(CONTROL_SCREEN, CONTROL_NUMBER_X + grove_x + grove_width/2 + dx,
+	    grove_y + dy + slider_y) = slider_color;
+}
+
+void blt_text(int screen_number, SDL_Surface * the_text, int x, int y,
+	      unsigned color)
+{
+  for(int dx=0;dx<the_text->w;dx++)
+    for(int dy=0;dy<the_text->h;dy++)
+      {
+	uint8_t c = * (uint8_t *) ((uint8_t *) the_text->pixels
+				   + dy * the_text->pitch
+				   + dx * the_text->format->BytesPerPixel);
+	if (c)
+	  {
+	    int xx = x + dx;
+	    int yy = y + dy;
+	    if (xx>=0 && yy>=0 && xx < SCREEN_WIDTH[screen_number]
+		&& yy < SCREEN_HEIGHT[screen_number])
+	      point(screen_number, xx, yy) = color;
+	  }
+      }
+}
+
+// Draws the control window
+void draw_controls()
+{
+  // Background fill
+  for(int y=0; y<SCREEN_HEIGHT[1]; y++)
+    for(int x=0; x<SCREEN_WIDTH[1]; x++)
+      point(CONTROL_SCREEN,x,y) = CONTROL_BG_COLOR;
+
+  // Main controls
+  for(int i = 0; i < dim; i++)
+    {
+      // Text
+      int number = i % MAX_TEXT_NUMBER;
+      blt_text(CONTROL_SCREEN, text[number], CONTROL_NUMBER_XLOC,
+	       CONTROL_NUMBER_YLOC + i*CONTROL_Y_STEP - control_scroll, 0xa0a0a0);
+      
+      // Circle displays
+      for(int y=0;y<2*CONTROL_RADIUS;y++)
+	{
+	  int yy = y + i*CONTROL_Y_STEP - control_scroll;
+	  if (yy < 0 || yy >= SCREEN_HEIGHT[CONTROL_SCREEN]) continue;
+	  int y0 = y - CONTROL_RADIUS;
+	  for(int x=0;x<2*CONTROL_RADIUS;x++)
+	    {
+	      int xx = x + CONTROL_NUMBER_X;   	 
+	      int x0 = x - CONTROL_RADIUS;
+	      if (SQR(x0) + SQR(y0) <= SQR(CONTROL_RADIUS))
+		{
+		  if (xx < 0 || xx >= SCREEN_WIDTH[CONTROL_SCREEN]) continue;
+		  point(CONTROL_SCREEN, xx, yy) = CONTROL_FG_COLOR;
+		}
+	    }
+	}
+      double dx = CONTROL_RADIUS * A[AF(i,0)];
+      double dy = CONTROL_RADIUS * A[AF(i,1)];
+      for(double r=0.0; r<1.0; r+=CONTROL_LINE_STEP)
+	{
+	  for(int dx2=-CONTROL_ARROW_THICKNESS;dx2<=CONTROL_ARROW_THICKNESS;dx2++)
+	    {
+	      int xx =CONTROL_NUMBER_X + dx2 + (int)(CONTROL_RADIUS+dx*r);
+	      if (xx <= 0 || xx >= SCREEN_WIDTH[CONTROL_SCREEN]) continue;
+	      for(int dy2=-CONTROL_ARROW_THICKNESS;dy2<=CONTROL_ARROW_THICKNESS;
+		  dy2++)
+		{  		 
+		  int yy = dy2 + (int)(i*CONTROL_Y_STEP+CONTROL_RADIUS+dy*r)
+		    - control_scroll;
+		  if (yy <= 0 || yy >= SCREEN_HEIGHT[CONTROL_SCREEN]) continue;
+		  point(CONTROL_SCREEN, xx, yy) = CONTROL_ARROW_COLOR;
+		}
+	    }
+	}
+      
+      // Boxes
+      SDL_Surface * box_text[4] = {text_x, text_y, text_r, text_xy};
+      for(int bi = 0; bi < CONTROL_NUM_BOX; bi++)
+	{
+	  for(int y=-CONTROL_BOX_RADIUS;y<=CONTROL_BOX_RADIUS;y++)
+	    {
+	      int yy = y+i*CONTROL_Y_STEP + CONTROL_RADIUS - control_scroll;
+	      if (yy < 0 || yy >= SCREEN_HEIGHT[CONTROL_SCREEN]) continue;
+	      for(int x=-CONTROL_BOX_RADIUS;x<=CONTROL_BOX_RADIUS;x++)
+		{
+		  int xx = CONTROL_NUMBER_X +
+		    x+CONTROL_Y_STEP*(bi+CONTROL_BOX_SHIFT) + CONTROL_RADIUS;
+		  if (xx < 0 || xx >= SCREEN_WIDTH[CONTROL_SCREEN]) continue;
+		  int color;
+		  if (y==-CONTROL_BOX_RADIUS || x==-CONTROL_BOX_RADIUS || \
+		      y==CONTROL_BOX_RADIUS || x==CONTROL_BOX_RADIUS)
+		    color = CONTROL_BOX_FG;
+		  else
+		    color = box[i][bi] ? CONTROL_BOX_SELECT : CONTROL_BOX_BG;
+		  point(CONTROL_SCREEN, xx, yy) = color;
+		}
+	    }
+	  int x = 27+CONTROL_NUMBER_X + CONTROL_Y_STEP*(bi+CONTROL_BOX_SHIFT);
+	  int y = i*CONTROL_Y_STEP + CONTROL_RADIUS - control_scroll - 13;
+	  if (bi == 3) x-=12;
+	  blt_text(CONTROL_SCREEN, box_text[bi], x, y, 0x900000);
+	}
+    }
+
+  // Blt logo
+  blt(image_logo, CONTROL_SCREEN,
+      450, SCREEN_HEIGHT[CONTROL_SCREEN] - 225, 225, 225,0);
+  
+  // Rotation mode indicator
+  blt(image_rotation, CONTROL_SCREEN,
+      SCREEN_WIDTH[CONTROL_SCREEN] - ROTATION_MODE_MARGIN_X
+      - ROTATION_MODE_BOX_SIZE - 60,
+      ROTATION_MODE_MARGIN_Y,
+      ROTATION_MODE_BOX_SIZE, ROTATION_MODE_BOX_SIZE,
+      rotation_mode_color[rotation_mode]);
 
-  // Blt logo
-  blt(image_logo, CONTROL_SCREEN,
-      450, SCREEN_HEIGHT[CONTROL_SCREEN] - 225, 225, 225,0);
-  
-  // Rotation mode indicator
-  blt(image_rotation, CONTROL_SCREEN,
-      SCREEN_WIDTH[CONTROL_SCREEN] - ROTATION_MODE_MARGIN_X
-      - ROTATION_MODE_BOX_SIZE - 60,
-      ROTATION_MODE_MARGIN_Y,
-      ROTATION_MODE_BOX_SIZE, ROTATION_MODE_BOX_SIZE,
-      rotation_mode_color[rotation_mode]);
-
   // Decimation indicator
   blt(image_cut, CONTROL_SCREEN,
       SCREEN_WIDTH[CONTROL_SCREEN] - ROTATION_MODE_MARGIN_X
@@ -513,361 +1583,1058 @@ void draw_controls()
 	     ROTATION_MODE_MARGIN_X - ROTATION_MODE_BOX_SIZE + 20,
 	     ROTATION_MODE_MARGIN_Y + 10, 0xffffff);
   
-  // Draw sliders
-  draw_slider(ZOOM_LOG_RATIO, zoom_ratio, ZOOM_GROVE_WIDTH, ZOOM_GROVE_HEIGHT,
-	      ZOOM_GROVE_X, ZOOM_GROVE_Y, ZOOM_SLIDER_WIDTH, ZOOM_SLIDER_HEIGHT,
-	      ZOOM_GROVE_COLOR, ZOOM_SLIDER_COLOR);
-  draw_slider(ZOOM_LOG_RATIO, rotation_speed, ZOOM_GROVE_WIDTH, ZOOM_GROVE_HEIGHT,
-	      SPEED_GROVE_X, ZOOM_GROVE_Y, ZOOM_SLIDER_WIDTH, ZOOM_SLIDER_HEIGHT,
-	      ZOOM_GROVE_COLOR, ZOOM_SLIDER_COLOR);
-  draw_slider(POINTSIZE_LOG_RATIO, point_size/POINTSIZE_DIV, ZOOM_GROVE_WIDTH,
-	      ZOOM_GROVE_HEIGHT, POINTSIZE_GROVE_X, ZOOM_GROVE_Y, ZOOM_SLIDER_WIDTH,
-	      ZOOM_SLIDER_HEIGHT, ZOOM_GROVE_COLOR, ZOOM_SLIDER_COLOR);
-  draw_slider(ZOOM_LOG_RATIO, gamma_correct, ZOOM_GROVE_WIDTH,
-	      ZOOM_GROVE_HEIGHT, INTENSITY_GROVE_X, ZOOM_GROVE_Y, ZOOM_SLIDER_WIDTH,
-	      ZOOM_SLIDER_HEIGHT, ZOOM_GROVE_COLOR, ZOOM_SLIDER_COLOR);
+  // Draw sliders
+  draw_slider(ZOOM_LOG_RATIO, zoom_ratio, ZOOM_GROVE_WIDTH, ZOOM_GROVE_HEIGHT,
+	      ZOOM_GROVE_X, ZOOM_GROVE_Y, ZOOM_SLIDER_WIDTH, ZOOM_SLIDER_HEIGHT,
+	      ZOOM_GROVE_COLOR, ZOOM_SLIDER_COLOR);
+  draw_slider(ZOOM_LOG_RATIO, rotation_speed, ZOOM_GROVE_WIDTH, ZOOM_GROVE_HEIGHT,
+	      SPEED_GROVE_X, ZOOM_GROVE_Y, ZOOM_SLIDER_WIDTH, ZOOM_SLIDER_HEIGHT,
+	      ZOOM_GROVE_COLOR, ZOOM_SLIDER_COLOR);
+  draw_slider(POINTSIZE_LOG_RATIO, point_size/POINTSIZE_DIV, ZOOM_GROVE_WIDTH,
+	      ZOOM_GROVE_HEIGHT, POINTSIZE_GROVE_X, ZOOM_GROVE_Y, ZOOM_SLIDER_WIDTH,
+	      ZOOM_SLIDER_HEIGHT, ZOOM_GROVE_COLOR, ZOOM_SLIDER_COLOR);
+  draw_slider(ZOOM_LOG_RATIO, gamma_correct, ZOOM_GROVE_WIDTH,
+	      ZOOM_GROVE_HEIGHT, INTENSITY_GROVE_X, ZOOM_GROVE_Y, ZOOM_SLIDER_WIDTH,
+	      ZOOM_SLIDER_HEIGHT, ZOOM_GROVE_COLOR, ZOOM_SLIDER_COLOR);
+
+  // Slider indicators
+  blt(image_slider_speed, CONTROL_SCREEN,
+      SCREEN_WIDTH[CONTROL_SCREEN] - ROTATION_MODE_MARGIN_X - 81 - 40,
+      ROTATION_MODE_MARGIN_Y + 55,
+      ROTATION_MODE_BOX_SIZE/1.7, ROTATION_MODE_BOX_SIZE/1.7,
+      0xa0a0ff);
+  blt(image_slider_zoom, CONTROL_SCREEN,
+      SCREEN_WIDTH[CONTROL_SCREEN] - ROTATION_MODE_MARGIN_X - 81,
+      ROTATION_MODE_MARGIN_Y + 55,
+      ROTATION_MODE_BOX_SIZE/1.7, ROTATION_MODE_BOX_SIZE/1.7,
+      0xa0a0ff);
+  blt(image_slider_point, CONTROL_SCREEN,
+      SCREEN_WIDTH[CONTROL_SCREEN] - ROTATION_MODE_MARGIN_X - 81 + 40,
+      ROTATION_MODE_MARGIN_Y + 55,
+      ROTATION_MODE_BOX_SIZE/1.7, ROTATION_MODE_BOX_SIZE/1.7,
+      0xa0a0ff);
+  blt(image_slider_intensity, CONTROL_SCREEN,
+      SCREEN_WIDTH[CONTROL_SCREEN] - ROTATION_MODE_MARGIN_X - 81 + 80,
+      ROTATION_MODE_MARGIN_Y + 55,
+      ROTATION_MODE_BOX_SIZE/1.7, ROTATION_MODE_BOX_SIZE/1.7,
+      0xa0a0ff);
+}
+
+int cmp_int64(const void * p1, const void * p2)
+{
+  uint64_t x1 = *((uint64_t *) p1);
+  uint64_t x2 = *((uint64_t *) p2);
+  if (x1 < x2) return -1;
+  if (x2 < x1) return 1;
+  return 0;
+}
+
+// Draws the brush window
+void draw_palette(int num_data, double (*data)[dim], int32_t * color,
+		  uint64_t * hide)
+{
+  unsigned mask = color_table_mask();
+  
+  for(int y=0;y<SCREEN_HEIGHT[BRUSH_SCREEN];y++)
+    for(int x=0;x<SCREEN_WIDTH[BRUSH_SCREEN];x++)
+      point(BRUSH_SCREEN,x,y) = BRUSH_BG;
+
+  for(int bx=0;bx<30;bx++)
+    {
+      int bit_color = ((mask >> bx) & 1) ? BIT_USED_COLOR : BIT_UNUSED_COLOR;
+      for(int x=-BIT_RADIUS;x<=BIT_RADIUS;x++)
+	for(int y=-BIT_RADIUS;y<=BIT_RADIUS;y++)
+	  {
+	    if (SQR(x) + SQR(y) <= SQR(BIT_RADIUS))
+	      {
+		point(BRUSH_SCREEN, x + (bx + 1) * BIT_X_SKIP,
+		      30 + y + BIT_RADIUS) = bit_color;
+	      }
+	  }
+
+      if (bx % 3 != 1) continue;
+
+      bit_color = ((mask >> bx) & 7) ? BIT_USED_COLOR : BIT_UNUSED_COLOR;
+
+      for(int x=-BIT_RADIUS;x<=BIT_RADIUS;x++)
+	for(int y=-BIT_RADIUS;y<=BIT_RADIUS;y++)
+	  {
+	    if (SQR(x) + SQR(y) <= SQR(BIT_RADIUS))
+	      {
+		point(BRUSH_SCREEN, x + (bx + 1) * BIT_X_SKIP,
+		      30 + y + BIT_RADIUS + BIT_X_SKIP + 10) = bit_color;
+	      }
+	  }
+    }
+
+  if (brush_color_mode == BRUSH_COLOR_MODE_DIRECT)
+    {
+      for(int x = 0; x < 3 * BIT_X_SKIP; x++)
+	for(int y = 0; y < 5; y++)
+	  {
+	    point(BRUSH_SCREEN, BIT_X_SKIP*mask_location + x+10,
+		  y + BIT_X_SKIP / 2) = BIT_SELECT_COLOR;
+	    point(BRUSH_SCREEN, BIT_X_SKIP*mask_location + x+10,
+		  y + 30 + BIT_X_SKIP) = BIT_SELECT_COLOR;
+	  }
+    }
+  
+  if (brush_color_mode == BRUSH_COLOR_MODE_DIRECT)
+    {
+      for(int c=0; c < 8; c++)
+	{
+	  if (c == selected_color)
+	    {
+ 	      for(int x=-PALETTE_BOX_MARGIN;
+		  x<PALETTE_BOX_SIZE+PALETTE_BOX_MARGIN;x++)
+		for(int y=-PALETTE_BOX_MARGIN;
+		    y<PALETTE_BOX_SIZE+PALETTE_BOX_MARGIN;y++)
+		  point(BRUSH_SCREEN, BIT_X_SKIP/2 + x + c*PALETTE_BOX_SKIP,
+			y+130) = SELECTED_PALETTE_BOX_BG;      
+	    }
+	  
+	  for(int x=0;x<PALETTE_BOX_SIZE;x++)
+	    for(int y=0;y<PALETTE_BOX_SIZE;y++)
+	      point(BRUSH_SCREEN, BIT_X_SKIP/2 + x + c*PALETTE_BOX_SKIP,
+		    y+130) = brush_color[c];      
+	}
+    }
+  else
+    {
+      int c0 = selected_color - 4;
+      if (c0 < 0) c0 = 0;
+      for(int c=0; c < 8; c++)
+	{
+	  if (c0 + c == selected_color)
+	    {
+	      for(int x=-PALETTE_BOX_MARGIN;
+		  x<PALETTE_BOX_SIZE+PALETTE_BOX_MARGIN;x++)
+		for(int y=-PALETTE_BOX_MARGIN;
+		    y<PALETTE_BOX_SIZE+PALETTE_BOX_MARGIN;y++)
+		  point(BRUSH_SCREEN, BIT_X_SKIP/2 + x + c*PALETTE_BOX_SKIP,
+			y+130) = SELECTED_PALETTE_BOX_BG;
+	    }
+	  
+	  for(int x=0;x<PALETTE_BOX_SIZE;x++)
+	    for(int y=0;y<PALETTE_BOX_SIZE;y++)
+	      point(BRUSH_SCREEN, BIT_X_SKIP/2 + x + c*PALETTE_BOX_SKIP, y+130)
+		= COLOR_HASH(c0 + c, brush_color_mode);
+	}
+    }
+  
+  // Draw brush mode icon
+  blt(image_erase, BRUSH_SCREEN,
+      SCREEN_WIDTH[BRUSH_SCREEN] - BRUSH_MODE_MARGIN - BRUSH_MODE_BOX_SIZE,
+      SCREEN_HEIGHT[BRUSH_SCREEN] - BRUSH_MODE_MARGIN - BRUSH_MODE_BOX_SIZE,
+      BRUSH_MODE_BOX_SIZE, BRUSH_MODE_BOX_SIZE,
+      erase_mode_on ? 0x00ff00 : 0xff0000);
 
-  // Slider indicators
-  blt(image_slider_speed, CONTROL_SCREEN,
-      SCREEN_WIDTH[CONTROL_SCREEN] - ROTATION_MODE_MARGIN_X - 81 - 40,
-      ROTATION_MODE_MARGIN_Y + 55,
-      ROTATION_MODE_BOX_SIZE/1.7, ROTATION_MODE_BOX_SIZE/1.7,
-      0xa0a0ff);
-  blt(image_slider_zoom, CONTROL_SCREEN,
-      SCREEN_WIDTH[CONTROL_SCREEN] - ROTATION_MODE_MARGIN_X - 81,
-      ROTATION_MODE_MARGIN_Y + 55,
-      ROTATION_MODE_BOX_SIZE/1.7, ROTATION_MODE_BOX_SIZE/1.7,
-      0xa0a0ff);
-  blt(image_slider_point, CONTROL_SCREEN,
-      SCREEN_WIDTH[CONTROL_SCREEN] - ROTATION_MODE_MARGIN_X - 81 + 40,
-      ROTATION_MODE_MARGIN_Y + 55,
-      ROTATION_MODE_BOX_SIZE/1.7, ROTATION_MODE_BOX_SIZE/1.7,
-      0xa0a0ff);
-  blt(image_slider_intensity, CONTROL_SCREEN,
-      SCREEN_WIDTH[CONTROL_SCREEN] - ROTATION_MODE_MARGIN_X - 81 + 80,
-      ROTATION_MODE_MARGIN_Y + 55,
-      ROTATION_MODE_BOX_SIZE/1.7, ROTATION_MODE_BOX_SIZE/1.7,
-      0xa0a0ff);
+  // Draw color mode icon
+  blt(image_palette, BRUSH_SCREEN,
+      SCREEN_WIDTH[BRUSH_SCREEN] - 2 * BRUSH_MODE_MARGIN - 2 * BRUSH_MODE_BOX_SIZE,
+      SCREEN_HEIGHT[BRUSH_SCREEN] - BRUSH_MODE_MARGIN - BRUSH_MODE_BOX_SIZE,
+      BRUSH_MODE_BOX_SIZE, BRUSH_MODE_BOX_SIZE,
+      brush_color_mode ? COLOR_HASH(0,brush_color_mode) : 0xff0000);
+
+  // Text - numbering of boxes
+  if (brush_color_mode == BRUSH_COLOR_MODE_DIRECT)
+    {
+      for(int i = 0; i < 8;i++)
+	{
+	  int number = i % MAX_TEXT_NUMBER;	  
+	  blt_text(BRUSH_SCREEN, text[number],
+		   9 + BIT_X_SKIP/2 + i*PALETTE_BOX_SKIP , 40 + 130, 0xa0a0a0);
+	}
+    }
+  else 
+    {
+      int c0 = selected_color - 4;
+      if (c0 < 0) c0 = 0;
+
+      for(int i = 0; i < 8;i++)
+	{
+
+	  int number = (i + c0) % MAX_TEXT_NUMBER;	  
+	  blt_text(BRUSH_SCREEN, text[number],
+		   9 + BIT_X_SKIP/2 + i*PALETTE_BOX_SKIP , 40 + 130, 0xa0a0a0);
+	}
+    }
+
+
+  // Text - selected color
+  char the_text[MAX_STRING];
+  SDL_Color white = {255, 255, 255};
+  SDL_Surface * text_surface;
+  sprintf(the_text, "%x", selected_color);
+  text_surface = TTF_RenderText_Solid(font, the_text, white);
+  if (text_surface == NULL) ERROR("TTF_RenderText_Solid failure");
+  blt_text(BRUSH_SCREEN, text_surface,
+	   SCREEN_WIDTH[BRUSH_SCREEN] - 2 * BRUSH_MODE_MARGIN -
+	   2 *BRUSH_MODE_BOX_SIZE, 40 + 130, 0xa0a0a0);
+  SDL_FreeSurface(text_surface);
+
+  // Pie-chart
+  struct pie_slice * slice;
+  if ((slice = malloc(color_table_used * sizeof(struct pie_slice))) == NULL)
+    {fprintf(stderr, "Out of memory\n");exit(1);}
+  int num_slices = pie_slices(slice);
+  for(int y=0;y<2*PIE_CHART_SIZE && num_slices;y++)
+    for(int x=0;x<2*PIE_CHART_SIZE;x++)
+      {
+	int dx = x - PIE_CHART_SIZE;
+	int dy = y - PIE_CHART_SIZE;
+	int c = 0;
+        if (SQR(dx) + SQR(dy) >= SQR(PIE_CHART_SIZE)) continue;
+	int r = (int)(num_data * (atan2(dy,dx) + M_PI) / (2 * M_PI + 0.0001));
+	struct pie_slice * sl = pie_find(slice, num_slices, r);
+	if (SQR(dx) + SQR(dy) >= SQR(3.0*PIE_CHART_SIZE/4.0)
+	    || r < sl->group_visible_end) c = sl->rgb;
+	point(BRUSH_SCREEN, x + PIE_CHART_X, y + PIE_CHART_Y) = c;	  
+      }
+  free(slice);
+}
+
+void xy_tally(int *xy_dim, int *xy_cnt)
+{
+  for(int i=0;i<dim;i++)
+    {
+      if (box[i][3]) xy_dim[(*xy_cnt)++] = i;
+    }
+}
+
+// Submit the queued quads with a single geometry call
+void batch_flush()
+{
+  if (batch_count == 0) return;
+  SDL_RenderGeometry(renderer[POINT_SCREEN], point_texture,
+		     batch_vertex, 4 * batch_count,
+		     batch_index, 6 * batch_count);
+  batch_count = 0;
+}
+
+// Queue one point as a textured quad, color already gamma mapped
+void batch_point(int x, int y, unsigned c)
+{
+  float x0 = (int)(x - point_size);
+  float y0 = (int)(y - point_size);
+  float x1 = x0 + point_surface->w;
+  float y1 = y0 + point_surface->h;
+  SDL_Color vc = {(c>>16) & 0xff, (c>>8) & 0xff, (c>>0) & 0xff, 255};
+  SDL_Vertex * v = &batch_vertex[4 * batch_count];
+  v[0] = (SDL_Vertex) {{x0, y0}, vc, {0.0, 0.0}};
+  v[1] = (SDL_Vertex) {{x1, y0}, vc, {1.0, 0.0}};
+  v[2] = (SDL_Vertex) {{x0, y1}, vc, {0.0, 1.0}};
+  v[3] = (SDL_Vertex) {{x1, y1}, vc, {1.0, 1.0}};
+  if (++batch_count == BATCH_POINTS) batch_flush();
+}
+
+// Set up the vertex buffer and the (fixed) quad index buffer
+void batch_init()
+{
+  if ((batch_vertex = malloc(4 * BATCH_POINTS * sizeof(SDL_Vertex))) == NULL)
+    ERROR("OUT OF MEMORY");
+  if ((batch_index = malloc(6 * BATCH_POINTS * sizeof(int))) == NULL)
+    ERROR("OUT OF MEMORY");
+  for(int q=0;q<BATCH_POINTS;q++)
+    {
+      batch_index[6*q + 0] = 4*q + 0;
+      batch_index[6*q + 1] = 4*q + 1;
+      batch_index[6*q + 2] = 4*q + 2;
+      batch_index[6*q + 3] = 4*q + 2;
+      batch_index[6*q + 4] = 4*q + 1;
+      batch_index[6*q + 5] = 4*q + 3;
+    }
+  batch_count = 0;
+}
+
+// Saturating add of color c onto n consecutive pixels, which stay opaque
+// (the texture is added with its alpha, dstRGB += srcRGB * srcA)
+void add_span_scalar(unsigned * row, int n, unsigned c)
+{
+  for(int x=0;x<n;x++)
+    {
+      unsigned p = row[x];
+      unsigned r = ((p >> 16) & 0xff) + ((c >> 16) & 0xff);
+      unsigned g = ((p >> 8) & 0xff) + ((c >> 8) & 0xff);
+      unsigned b = (p & 0xff) + (c & 0xff);
+      row[x] = 0xff000000 | ((r > 0xff ? 0xff : r) << 16)
+	| ((g > 0xff ? 0xff : g) << 8) | (b > 0xff ? 0xff : b);
+    }
+}
+
+#ifdef __SSE2__
+void add_span_sse2(unsigned * row, int n, unsigned c)
+{
+  __m128i cc = _mm_set1_epi32(c);
+  int x = 0;
+  for(;x + 4 <= n;x += 4)
+    {
+      __m128i p = _mm_loadu_si128((__m128i *) &row[x]);
+      _mm_storeu_si128((__m128i *) &row[x], _mm_adds_epu8(p, cc));
+    }
+  add_span_scalar(&row[x], n - x, c);
+}
+
+__attribute__((target("avx2")))
+void add_span_avx2(unsigned * row, int n, unsigned c)
+{
+  __m256i cc = _mm256_set1_epi32(c);
+  int x = 0;
+  for(;x + 8 <= n;x += 8)
+    {
+      __m256i p = _mm256_loadu_si256((__m256i *) &row[x]);
+      _mm256_storeu_si256((__m256i *) &row[x], _mm256_adds_epu8(p, cc));
+    }
+  add_span_sse2(&row[x], n - x, c);
+}
+#endif
+
+void (*add_span)(unsigned * row, int n, unsigned c) = add_span_scalar;
+
+// Add the channels of color c onto n consecutive HDR pixels
+void add_hdr_span_scalar(uint32_t (*row)[4], int n, unsigned c)
+{
+  for(int x=0;x<n;x++)
+    {
+      row[x][0] += (c >> 16) & 0xff;
+      row[x][1] += (c >> 8) & 0xff;
+      row[x][2] += (c >> 0) & 0xff;
+    }
+}
+
+#ifdef __SSE2__
+void add_hdr_span_sse2(uint32_t (*row)[4], int n, unsigned c)
+{
+  __m128i cc = _mm_set_epi32(0, c & 0xff, (c >> 8) & 0xff, (c >> 16) & 0xff);
+  for(int x=0;x<n;x++)
+    {
+      __m128i p = _mm_loadu_si128((__m128i *) row[x]);
+      _mm_storeu_si128((__m128i *) row[x], _mm_add_epi32(p, cc));
+    }
+}
+
+__attribute__((target("avx2")))
+void add_hdr_span_avx2(uint32_t (*row)[4], int n, unsigned c)
+{
+  __m256i cc = _mm256_set_epi32(0, c & 0xff, (c >> 8) & 0xff, (c >> 16) & 0xff,
+				0, c & 0xff, (c >> 8) & 0xff, (c >> 16) & 0xff);
+  int x = 0;
+  for(;x + 2 <= n;x += 2)
+    {
+      __m256i p = _mm256_loadu_si256((__m256i *) row[x]);
+      _mm256_storeu_si256((__m256i *) row[x], _mm256_add_epi32(p, cc));
+    }
+  add_hdr_span_scalar(&row[x], n - x, c);
+}
+#endif
+
+void (*add_hdr_span)(uint32_t (*row)[4], int n, unsigned c) =
+  add_hdr_span_scalar;
+
+// Bit m set when lo <= col[m] < hi, for n <= 64 values
+uint64_t range_mask_scalar(const float * col, int n, float lo, float hi)
+{
+  uint64_t mask = 0;
+  for(int m=0;m<n;m++)
+    mask |= (uint64_t) (col[m] >= lo && col[m] < hi) << m;
+  return mask;
+}
+
+#ifdef __SSE2__
+uint64_t range_mask_sse2(const float * col, int n, float lo, float hi)
+{
+  if (n < 64) return range_mask_scalar(col, n, lo, hi);
+  __m128 l = _mm_set1_ps(lo);
+  __m128 h = _mm_set1_ps(hi);
+  uint64_t mask = 0;
+  for(int m=0;m<64;m+=4)
+    {
+      __m128 v = _mm_loadu_ps(&col[m]);
+      __m128 in = _mm_and_ps(_mm_cmpge_ps(v, l), _mm_cmplt_ps(v, h));
+      mask |= (uint64_t) _mm_movemask_ps(in) << m;
+    }
+  return mask;
+}
+
+__attribute__((target("avx2")))
+uint64_t range_mask_avx2(const float * col, int n, float lo, float hi)
+{
+  if (n < 64) return range_mask_scalar(col, n, lo, hi);
+  __m256 l = _mm256_set1_ps(lo);
+  __m256 h = _mm256_set1_ps(hi);
+  uint64_t mask = 0;
+  for(int m=0;m<64;m+=8)
+    {
+      __m256 v = _mm256_loadu_ps(&col[m]);
+      __m256 in = _mm256_and_ps(_mm256_cmp_ps(v, l, _CMP_GE_OQ),
+				_mm256_cmp_ps(v, h, _CMP_LT_OQ));
+      mask |= (uint64_t) _mm256_movemask_ps(in) << m;
+    }
+  return mask;
+}
+#endif
+
+uint64_t (*range_mask)(const float * col, int n, float lo, float hi) =
+  range_mask_scalar;
+
+// Pick the widest kernels the CPU supports
+void simd_init()
+{
+#ifdef __SSE2__
+  add_span = SDL_HasAVX2() ? add_span_avx2 : add_span_sse2;
+  range_mask = SDL_HasAVX2() ? range_mask_avx2 : range_mask_sse2;
+  add_hdr_span = SDL_HasAVX2() ? add_hdr_span_avx2 : add_hdr_span_sse2;
+  proj_dense = (SDL_HasAVX2() && __builtin_cpu_supports("fma")) ?
+    proj_dense_avx2 : proj_dense_sse2;
+#endif
+}
+
+// Disc kernel for the current point_size (matches create_point_texture)
+void splat_kernel()
+{
+  splat_radius = point_size;
+  for(int dy=-splat_radius;dy<=splat_radius;dy++)
+    {
+      int w = -1;
+      for(int dx=0;dx<=splat_radius;dx++)
+	if (SQR(dx) + SQR(dy) <= SQR(point_size) - 0.1) w = dx;
+      splat_span[dy + splat_radius] = w;
+    }
+}
+
+// Queue one point for the software rasterizer, color already gamma mapped
+void splat_point(int x, int y, unsigned c)
+{
+  if (splat_count == splat_capacity)
+    {
+      splat_capacity = splat_capacity ? 2 * splat_capacity : BATCH_POINTS;
+      if ((splat_xy = realloc(splat_xy, splat_capacity * sizeof(*splat_xy)))
+	  == NULL) ERROR("OUT OF MEMORY");
+      if ((splat_color = realloc(splat_color, splat_capacity * sizeof(uint32_t)))
+	  == NULL) ERROR("OUT OF MEMORY");
+      if ((splat_order = realloc(splat_order, splat_capacity * sizeof(int)))
+	  == NULL) ERROR("OUT OF MEMORY");
+    }
+  splat_xy[splat_count][0] = x;
+  splat_xy[splat_count][1] = y;
+  splat_color[splat_count] = c;
+  splat_count++;
+}
+
+// Rasterize all splats falling in band [y_lo, y_hi) of pnt[POINT_SCREEN],
+// or of hdr_accum in HDR mode (splat_order must be up to date)
+void splat_band(int y_lo, int y_hi)
+{
+  int width = SCREEN_WIDTH[POINT_SCREEN];
+  if (!splat_keep && hdr_on)
+    memset(hdr_accum + y_lo * width, 0, sizeof(*hdr_accum) * width * (y_hi - y_lo));
+  else if (!splat_keep)
+    for(int y=y_lo;y<y_hi;y++)
+      for(int x=0;x<width;x++)
+	point(POINT_SCREEN, x, y) = 0xff000000;
+  // Only the splats of rows within splat_radius of the band
+  int r_lo = y_lo - splat_radius < 0 ? 0 : y_lo - splat_radius;
+  int r_hi = y_hi + splat_radius > SCREEN_HEIGHT[POINT_SCREEN] ?
+    SCREEN_HEIGHT[POINT_SCREEN] : y_hi + splat_radius;
+  for(int j=splat_row[r_lo];j<splat_row[r_hi];j++)
+    {
+      int k = splat_order[j];
+      int x = splat_xy[k][0];
+      int y = splat_xy[k][1];
+      if (y + splat_radius < y_lo || y - splat_radius >= y_hi) continue;
+      int dy0 = (y - splat_radius < y_lo) ? y_lo - y : -splat_radius;
+      int dy1 = (y + splat_radius >= y_hi) ? y_hi - 1 - y : splat_radius;
+      for(int dy=dy0;dy<=dy1;dy++)
+	{
+	  int w = splat_span[dy + splat_radius];
+	  int x0 = x - w;
+	  int x1 = x + w + 1;
+	  if (x0 < 0) x0 = 0;
+	  if (x1 > width) x1 = width;
+	  if (x0 >= x1) continue;
+	  if (hdr_on) add_hdr_span(hdr_accum + (y + dy) * width + x0, x1 - x0,
+				   splat_color[k]);
+	  else add_span(&point(POINT_SCREEN, x0, y + dy), x1 - x0,
+			splat_color[k]);
+	}
+    }
+}
+
+void splat_job(int w, void * arg)
+{
+  int y_lo = SCREEN_HEIGHT[POINT_SCREEN] * w / num_workers;
+  int y_hi = SCREEN_HEIGHT[POINT_SCREEN] * (w + 1) / num_workers;
+  splat_band(y_lo, y_hi);
+  if (!hdr_on) return;
+  uint32_t m = 0;
+  uint32_t * sum = hdr_accum[y_lo * SCREEN_WIDTH[POINT_SCREEN]];
+  for(int j=0;j<4*(y_hi - y_lo)*SCREEN_WIDTH[POINT_SCREEN];j++)
+    if (sum[j] > m) m = sum[j];
+  hdr_band_max[w] = m;
+}
+
+// Tone map of a channel sum: log scale up to the brightest sum, then gamma
+unsigned char hdr_tone(uint32_t v)
+{
+  if (v == 0) return 0;
+  double t = log1p(v / 255.0) / log1p(hdr_max / 255.0);
+  return 255 * pow(t, gamma_correct) + 0.5;
+}
+
+void hdr_tone_job(int w, void * arg)
+{
+  int width = SCREEN_WIDTH[POINT_SCREEN];
+  int y_lo = SCREEN_HEIGHT[POINT_SCREEN] * w / num_workers;
+  int y_hi = SCREEN_HEIGHT[POINT_SCREEN] * (w + 1) / num_workers;
+  for(int j=y_lo*width;j<y_hi*width;j++)
+    {
+      unsigned rgb = 0;
+      for(int c=0;c<3;c++)
+	{
+	  uint32_t v = hdr_accum[j][c];
+	  rgb = (rgb << 8) | (v < HDR_LUT_SIZE ? hdr_lut[v] : hdr_tone(v));
+	}
+      pnt[POINT_SCREEN][j] = 0xff000000 | rgb;
+    }
+}
+
+// Tone map hdr_accum into pnt[POINT_SCREEN] and upload it, a screen sized
+// pass that is all an intensity change needs
+void hdr_flush()
+{
+  for(int v=0;v<HDR_LUT_SIZE;v++) hdr_lut[v] = hdr_tone(v);
+  pool_run(hdr_tone_job, NULL);
+  upload(POINT_SCREEN);
+}
+
+// Rasterize the queued splats, one horizontal band per worker, then upload
+void splat_flush()
+{
+  int pixels = SCREEN_WIDTH[POINT_SCREEN] * SCREEN_HEIGHT[POINT_SCREEN];
+  if (hdr_on && pixels > hdr_capacity)
+    {
+      free(hdr_accum);
+      if ((hdr_accum = malloc(pixels * sizeof(*hdr_accum))) == NULL)
+	{fprintf(stderr, "Out of memory\n");exit(1);}
+      hdr_capacity = pixels;
+    }
+
+  // Counting sort of the splats by row (clamped onto the screen), so each
+  // band walks only its own rows
+  int height = SCREEN_HEIGHT[POINT_SCREEN];
+  if (height + 1 > splat_row_capacity)
+    {
+      free(splat_row);
+      splat_row_capacity = height + 1;
+      if ((splat_row = malloc(splat_row_capacity * sizeof(int))) == NULL)
+	{fprintf(stderr, "Out of memory\n");exit(1);}
+    }
+  for(int y=0;y<=height;y++) splat_row[y] = 0;
+  for(int k=0;k<splat_count;k++)
+    {
+      int y = splat_xy[k][1];
+      splat_row[(y < 0 ? 0 : (y >= height ? height - 1 : y)) + 1]++;
+    }
+  for(int y=0;y<height;y++) splat_row[y + 1] += splat_row[y];
+  for(int k=0;k<splat_count;k++)
+    {
+      int y = splat_xy[k][1];
+      splat_order[splat_row[y < 0 ? 0 : (y >= height ? height - 1 : y)]++] = k;
+    }
+  // Each row start has moved on to the next, shift them back
+  for(int y=height;y>0;y--) splat_row[y] = splat_row[y - 1];
+  splat_row[0] = 0;
+
+  pool_run(splat_job, NULL);
+  splat_count = 0;
+  splat_keep = 0;
+  if (!hdr_on)
+    {
+      upload(POINT_SCREEN);
+      return;
+    }
+  hdr_max = 1;
+  for(int w=0;w<num_workers;w++)
+    if (hdr_band_max[w] > hdr_max) hdr_max = hdr_band_max[w];
+  hdr_valid = 1;
+  hdr_flush();
+}
+
+// Bin a share of the visible points into tile w
+void density_bin_job(int w, void * arg)
+{
+  if (w >= density_tiles) return;
+  int pixels = SCREEN_WIDTH[POINT_SCREEN] * SCREEN_HEIGHT[POINT_SCREEN];
+  uint32_t (*tile)[4] = density_tile + (size_t) w * pixels;
+  memset(tile, 0, pixels * sizeof(*tile));
+  int m0 = (int64_t) num_visible * w / density_tiles;
+  int m1 = (int64_t) num_visible * (w + 1) / density_tiles;
+  for(int m=m0;m<m1;m++)
+    {
+      int k = visible[m];
+      uint32_t * p = tile[(int) screen_y[k] * SCREEN_WIDTH[POINT_SCREEN]
+			  + (int) screen_x[k]];
+      unsigned c = display_color[k];
+      p[0] += (c >> 16) & 0xff;
+      p[1] += (c >> 8) & 0xff;
+      p[2] += (c >> 0) & 0xff;
+      p[3]++;
+    }
+}
+
+// Merge the tiles of band w into density_sum, blurring the rows if smoothing
+void density_merge_job(int w, void * arg)
+{
+  int width = SCREEN_WIDTH[POINT_SCREEN];
+  int pixels = width * SCREEN_HEIGHT[POINT_SCREEN];
+  int y_lo = SCREEN_HEIGHT[POINT_SCREEN] * w / num_workers;
+  int y_hi = SCREEN_HEIGHT[POINT_SCREEN] * (w + 1) / num_workers;
+  float (*out)[4] = (density_mode == DENSITY_MODE_SMOOTH) ?
+    density_tmp : density_sum;
+  float m = 0.0;
+  for(int j=y_lo*width;j<y_hi*width;j++)
+    for(int c=0;c<4;c++)
+      {
+	uint32_t v = 0;
+	for(int t=0;t<density_tiles;t++) v += density_tile[(size_t) t * pixels + j][c];
+	out[j][c] = v;
+	if (c == 3 && v > m) m = v;
+      }
+  density_band_max[w] = m;
+  if (density_mode != DENSITY_MODE_SMOOTH) return;
+  for(int y=y_lo;y<y_hi;y++)
+    for(int x=0;x<width;x++)
+      for(int c=0;c<4;c++)
+	{
+	  float v = 0.0;
+	  for(int d=-DENSITY_RADIUS;d<=DENSITY_RADIUS;d++)
+	    if (x + d >= 0 && x + d < width)
+	      v += density_kernel[abs(d)] * density_tmp[y * width + x + d][c];
+	  density_sum[y * width + x][c] = v;
+	}
+}
+
+// Blur the columns of band w (the rows are done) from density_sum
+void density_column_job(int w, void * arg)
+{
+  int width = SCREEN_WIDTH[POINT_SCREEN];
+  int height = SCREEN_HEIGHT[POINT_SCREEN];
+  int y_lo = height * w / num_workers;
+  int y_hi = height * (w + 1) / num_workers;
+  float m = 0.0;
+  for(int y=y_lo;y<y_hi;y++)
+    for(int x=0;x<width;x++)
+      for(int c=0;c<4;c++)
+	{
+	  float v = 0.0;
+	  for(int d=-DENSITY_RADIUS;d<=DENSITY_RADIUS;d++)
+	    if (y + d >= 0 && y + d < height)
+	      v += density_kernel[abs(d)] * density_sum[(y + d) * width + x][c];
+	  density_tmp[y * width + x][c] = v;
+	  if (c == 3 && v > m) m = v;
+	}
+  density_band_max[w] = m;
 }
 
-int cmp_int64(const void * p1, const void * p2)
+// Log scaled count (to the gamma of the intensity) times the mean color
+void density_tone_job(int w, void * arg)
 {
-  uint64_t x1 = *((uint64_t *) p1);
-  uint64_t x2 = *((uint64_t *) p2);
-  if (x1 < x2) return -1;
-  if (x2 < x1) return 1;
-  return 0;
+  int width = SCREEN_WIDTH[POINT_SCREEN];
+  int y_lo = SCREEN_HEIGHT[POINT_SCREEN] * w / num_workers;
+  int y_hi = SCREEN_HEIGHT[POINT_SCREEN] * (w + 1) / num_workers;
+  float (*sum)[4] = (density_mode == DENSITY_MODE_SMOOTH) ?
+    density_tmp : density_sum;
+  double scale = 1.0 / log1p(density_max);
+  for(int j=y_lo*width;j<y_hi*width;j++)
+    {
+      float n = sum[j][3];
+      if (n <= 0.0f)
+	{
+	  pnt[POINT_SCREEN][j] = 0xff000000;
+	  continue;
+	}
+      double t = pow(log1p(n) * scale, gamma_correct) / n;
+      unsigned rgb = 0;
+      for(int c=0;c<3;c++)
+	{
+	  int v = sum[j][c] * t + 0.5;
+	  rgb = (rgb << 8) | (v > 0xff ? 0xff : v);
+	}
+      pnt[POINT_SCREEN][j] = 0xff000000 | rgb;
+    }
 }
 
-// Draws the brush window
-void draw_palette(int num_data, double (*data)[dim], int32_t * color,
-		  int32_t * hide)
+// Draw the density of the visible points at screen_x/screen_y, or when
+// tone_only show the last one at the current intensity
+void density_draw(int tone_only)
 {
-  unsigned mask = 0;
-  for(int i = 0; i < num_data; i++) mask |= color[i];
-  
-  for(int y=0;y<SCREEN_HEIGHT[BRUSH_SCREEN];y++)
-    for(int x=0;x<SCREEN_WIDTH[BRUSH_SCREEN];x++)
-      point(BRUSH_SCREEN,x,y) = BRUSH_BG;
-
-  for(int bx=0;bx<30;bx++)
+  int pixels = SCREEN_WIDTH[POINT_SCREEN] * SCREEN_HEIGHT[POINT_SCREEN];
+  if (!tone_only || !density_valid)
     {
-      int bit_color = ((mask >> bx) & 1) ? BIT_USED_COLOR : BIT_UNUSED_COLOR;
-      for(int x=-BIT_RADIUS;x<=BIT_RADIUS;x++)
-	for(int y=-BIT_RADIUS;y<=BIT_RADIUS;y++)
-	  {
-	    if (SQR(x) + SQR(y) <= SQR(BIT_RADIUS))
-	      {
-		point(BRUSH_SCREEN, x + (bx + 1) * BIT_X_SKIP,
-		      30 + y + BIT_RADIUS) = bit_color;
-	      }
-	  }
+      // Fewer tiles than workers if they would take too much memory
+      density_tiles = DENSITY_MAX_PIXELS / pixels;
+      if (density_tiles > num_workers) density_tiles = num_workers;
+      if (density_tiles < 1) density_tiles = 1;
+      if ((size_t) density_tiles * pixels > density_tile_capacity)
+	{
+	  free(density_tile);
+	  density_tile_capacity = (size_t) density_tiles * pixels;
+	  if ((density_tile = malloc(density_tile_capacity
+				     * sizeof(*density_tile))) == NULL)
+	    {fprintf(stderr, "Out of memory\n");exit(1);}
+	}
+      if (pixels > density_capacity)
+	{
+	  free(density_sum);
+	  free(density_tmp);
+	  density_capacity = pixels;
+	  if ((density_sum = malloc(pixels * sizeof(*density_sum))) == NULL)
+	    {fprintf(stderr, "Out of memory\n");exit(1);}
+	  if ((density_tmp = malloc(pixels * sizeof(*density_tmp))) == NULL)
+	    {fprintf(stderr, "Out of memory\n");exit(1);}
+	}
+      double total = 0.0;
+      for(int d=0;d<=DENSITY_RADIUS;d++)
+	{
+	  density_kernel[d] = exp(-0.5 * SQR(d / DENSITY_SIGMA));
+	  total += (d ? 2 : 1) * density_kernel[d];
+	}
+      for(int d=0;d<=DENSITY_RADIUS;d++) density_kernel[d] /= total;
 
-      if (bx % 3 != 1) continue;
+      pool_run(density_bin_job, NULL);
+      pool_run(density_merge_job, NULL);
+      if (density_mode == DENSITY_MODE_SMOOTH)
+	pool_run(density_column_job, NULL);
+      density_max = 1.0;
+      for(int w=0;w<num_workers;w++)
+	if (density_band_max[w] > density_max) density_max = density_band_max[w];
+      density_valid = 1;
+    }
+  pool_run(density_tone_job, NULL);
+  upload(POINT_SCREEN);
+}
 
-      bit_color = ((mask >> bx) & 7) ? BIT_USED_COLOR : BIT_UNUSED_COLOR;
+// Finish the points of this frame on whichever render path is active
+void flush_points()
+{
+  if (hdr_on || render_mode == RENDER_MODE_SOFTWARE) splat_flush();
+  else batch_flush();
+}
 
-      for(int x=-BIT_RADIUS;x<=BIT_RADIUS;x++)
-	for(int y=-BIT_RADIUS;y<=BIT_RADIUS;y++)
-	  {
-	    if (SQR(x) + SQR(y) <= SQR(BIT_RADIUS))
-	      {
-		point(BRUSH_SCREEN, x + (bx + 1) * BIT_X_SKIP,
-		      30 + y + BIT_RADIUS + BIT_X_SKIP + 10) = bit_color;
-	      }
-	  }
+// Draw one point, c is a display color (already gamma mapped)
+void draw_point(int x, int y, unsigned c)
+{
+  // HDR always accumulates in software, whatever the render mode
+  if (hdr_on || render_mode == RENDER_MODE_SOFTWARE)
+    {
+      splat_point(x, y, c);
+      return;
     }
-
-  if (brush_color_mode == BRUSH_COLOR_MODE_DIRECT)
+  if (render_mode == RENDER_MODE_GEOMETRY)
     {
-      for(int x = 0; x < 3 * BIT_X_SKIP; x++)
-	for(int y = 0; y < 5; y++)
-	  {
-	    point(BRUSH_SCREEN, BIT_X_SKIP*mask_location + x+10,
-		  y + BIT_X_SKIP / 2) = BIT_SELECT_COLOR;
-	    point(BRUSH_SCREEN, BIT_X_SKIP*mask_location + x+10,
-		  y + 30 + BIT_X_SKIP) = BIT_SELECT_COLOR;
-	  }
+      batch_point(x, y, c);
+      return;
     }
-  
-  if (brush_color_mode == BRUSH_COLOR_MODE_DIRECT)
+  SDL_Rect dst_rect = {x - point_size, y - point_size,
+		       point_surface->w, point_surface->h};
+  SDL_SetTextureColorMod(point_texture, (c>>16) & 0xff, (c>>8) & 0xff,
+			 (c>>0) & 0xff);
+  SDL_RenderCopy(renderer[POINT_SCREEN], point_texture, NULL, &dst_rect);
+}
+
+// Arguments of the xx histogram job
+struct xx_job
+{
+  int32_t * color;
+  int num_data;
+  int xy_cnt;
+  int * slot_color;
+  int num_colors;
+};
+
+// Histogram counts, one [color][dim][bin] table per worker
+uint32_t * xx_count = NULL;
+size_t xx_count_capacity = 0;
+
+// Color table slot of a label that is in the table
+static inline int color_table_slot(int32_t label)
+{
+  unsigned i = color_table_hash(label);
+  while (color_table[i].label != label || color_table[i].count < 0)
+    i = (i + 1) & (color_table_capacity - 1);
+  return i;
+}
+
+// Bin every selected dim of the visible points m0..m1 at once
+void xx_range(int w, int m0, int m1, void * arg)
+{
+  struct xx_job * job = arg;
+  int xy_cnt = job->xy_cnt;
+  size_t table = (size_t) job->num_colors * xy_cnt * XY_BINS;
+  uint32_t * count = xx_count + w * table;
+  double bin_scale = (double) XY_BINS * xy_cnt / SCREEN_WIDTH[POINT_SCREEN];
+  double offset[xy_cnt];
+  for(int i=0;i<xy_cnt;i++)
+    offset[i] = (i + 0.5) * SCREEN_HEIGHT[POINT_SCREEN] / xy_cnt
+      - i * SCREEN_WIDTH[POINT_SCREEN] / xy_cnt;
+  int32_t last_label = 0;
+  int c = -1;
+  for(int m=m0;m<m1;m++)
     {
-      for(int c=0; c < 8; c++)
+      int k = visible[m];
+      if (c < 0 || job->color[k] != last_label)
 	{
-	  if (c == selected_color)
-	    {
- 	      for(int x=-PALETTE_BOX_MARGIN;
-		  x<PALETTE_BOX_SIZE+PALETTE_BOX_MARGIN;x++)
-		for(int y=-PALETTE_BOX_MARGIN;
-		    y<PALETTE_BOX_SIZE+PALETTE_BOX_MARGIN;y++)
-		  point(BRUSH_SCREEN, BIT_X_SKIP/2 + x + c*PALETTE_BOX_SKIP,
-			y+130) = SELECTED_PALETTE_BOX_BG;      
-	    }
-	  
-	  for(int x=0;x<PALETTE_BOX_SIZE;x++)
-	    for(int y=0;y<PALETTE_BOX_SIZE;y++)
-	      point(BRUSH_SCREEN, BIT_X_SKIP/2 + x + c*PALETTE_BOX_SKIP,
-		    y+130) = brush_color[c];      
+	  last_label = job->color[k];
+	  c = job->slot_color[color_table_slot(last_label)];
 	}
-    }
-  else
-    {
-      int c0 = selected_color - 4;
-      if (c0 < 0) c0 = 0;
-      for(int c=0; c < 8; c++)
+      uint32_t * row = count + (size_t) c * xy_cnt * XY_BINS;
+      for(int i=0;i<xy_cnt;i++)
 	{
-	  if (c0 + c == selected_color)
-	    {
-	      for(int x=-PALETTE_BOX_MARGIN;
-		  x<PALETTE_BOX_SIZE+PALETTE_BOX_MARGIN;x++)
-		for(int y=-PALETTE_BOX_MARGIN;
-		    y<PALETTE_BOX_SIZE+PALETTE_BOX_MARGIN;y++)
-		  point(BRUSH_SCREEN, BIT_X_SKIP/2 + x + c*PALETTE_BOX_SKIP,
-			y+130) = SELECTED_PALETTE_BOX_BG;
-	    }
-	  
-	  for(int x=0;x<PALETTE_BOX_SIZE;x++)
-	    for(int y=0;y<PALETTE_BOX_SIZE;y++)
-	      point(BRUSH_SCREEN, BIT_X_SKIP/2 + x + c*PALETTE_BOX_SKIP, y+130)
-		= COLOR_HASH(c0 + c, brush_color_mode);
+	  double bin_float = (offset[i] + xy_col[(size_t) i * job->num_data + k])
+	    * bin_scale;
+	  int bin;
+	  if (bin_float < 0) bin = 0;
+	  else if (bin_float >= XY_BINS) bin = XY_BINS - 1;
+	  else bin = bin_float;
+	  row[i * XY_BINS + bin]++;
 	}
     }
-  
-  // Draw brush mode icon
-  blt(image_erase, BRUSH_SCREEN,
-      SCREEN_WIDTH[BRUSH_SCREEN] - BRUSH_MODE_MARGIN - BRUSH_MODE_BOX_SIZE,
-      SCREEN_HEIGHT[BRUSH_SCREEN] - BRUSH_MODE_MARGIN - BRUSH_MODE_BOX_SIZE,
-      BRUSH_MODE_BOX_SIZE, BRUSH_MODE_BOX_SIZE,
-      erase_mode_on ? 0x00ff00 : 0xff0000);
+}
 
-  // Draw color mode icon
-  blt(image_palette, BRUSH_SCREEN,
-      SCREEN_WIDTH[BRUSH_SCREEN] - 2 * BRUSH_MODE_MARGIN - 2 * BRUSH_MODE_BOX_SIZE,
-      SCREEN_HEIGHT[BRUSH_SCREEN] - BRUSH_MODE_MARGIN - BRUSH_MODE_BOX_SIZE,
-      BRUSH_MODE_BOX_SIZE, BRUSH_MODE_BOX_SIZE,
-      brush_color_mode ? COLOR_HASH(0,brush_color_mode) : 0xff0000);
+// Draws the histograms on the diagonal of the x/y matrix (xx_plot), binning
+// all selected dims in one pass over the visible points (or with the counts
+// of the last call when count is 0)
+void draw_xx_plots(int num_data, int32_t * color, int xy_cnt, int count)
+{
+  // Display colors of the labels with visible points
+  int * slot_color;
+  uint64_t * rgb_slot;
+  uint32_t * c_value;
+  if ((slot_color = malloc(color_table_capacity * sizeof(int))) == NULL)
+    {fprintf(stderr, "Out of memory\n");exit(1);}
+  if ((rgb_slot = malloc(color_table_used * sizeof(uint64_t))) == NULL)
+    {fprintf(stderr, "Out of memory\n");exit(1);}
+  if ((c_value = malloc(color_table_used * sizeof(uint32_t))) == NULL)
+    {fprintf(stderr, "Out of memory\n");exit(1);}
+  int n = 0;
+  for(int j=0;j<color_table_capacity;j++)
+    if (color_table[j].count > color_table[j].hidden)
+      rgb_slot[n++] = ((uint64_t) get_color(color_table[j].label) << 32) + j;
+  qsort(rgb_slot, n, sizeof(uint64_t), &cmp_int64);
+  int num_colors = 0;
+  for(int j=0;j<n;j++)
+    {
+      if (!j || (rgb_slot[j] >> 32) != (rgb_slot[j-1] >> 32))
+	c_value[num_colors++] = rgb_slot[j] >> 32;
+      slot_color[rgb_slot[j] & 0xffffffff] = num_colors - 1;
+    }
 
-  // Text - numbering of boxes
-  if (brush_color_mode == BRUSH_COLOR_MODE_DIRECT)
+  // Count, one table per worker unless that is too big
+  size_t table = (size_t) num_colors * xy_cnt * XY_BINS;
+  int workers = (table * num_workers <= XX_MAX_COUNTS) ? num_workers : 1;
+  if (count && table * workers > xx_count_capacity)
     {
-      for(int i = 0; i < 8;i++)
-	{
-	  int number = i % MAX_TEXT_NUMBER;	  
-	  blt_text(BRUSH_SCREEN, text[number],
-		   9 + BIT_X_SKIP/2 + i*PALETTE_BOX_SKIP , 40 + 130, 0xa0a0a0);
-	}
+      free(xx_count);
+      xx_count_capacity = table * workers;
+      if ((xx_count = malloc(xx_count_capacity * sizeof(uint32_t))) == NULL)
+	{fprintf(stderr, "Out of memory\n");exit(1);}
     }
-  else 
+  if (count)
     {
-      int c0 = selected_color - 4;
-      if (c0 < 0) c0 = 0;
+      memset(xx_count, 0, table * workers * sizeof(uint32_t));
+      struct xx_job job = {color, num_data, xy_cnt, slot_color, num_colors};
+      if (workers > 1) pool_for(num_visible, xx_range, &job);
+      else xx_range(0, 0, num_visible, &job);
+      for(int w=1;w<workers;w++)
+	for(size_t j=0;j<table;j++) xx_count[j] += xx_count[w * table + j];
+    }
 
-      for(int i = 0; i < 8;i++)
-	{
+  // Find maximum count of each dim.
+  uint32_t max_count[xy_cnt];
+  for(int i=0;i<xy_cnt;i++)
+    {
+      max_count[i] = 1;
+      for(int c=0;c<num_colors;c++)
+	for(int b=0;b<XY_BINS;b++)
+	  {
+	    uint32_t v = xx_count[((size_t) c * xy_cnt + i) * XY_BINS + b];
+	    if (v > max_count[i]) max_count[i] = v;
+	  }
+    }
 
-	  int number = (i + c0) % MAX_TEXT_NUMBER;	  
-	  blt_text(BRUSH_SCREEN, text[number],
-		   9 + BIT_X_SKIP/2 + i*PALETTE_BOX_SKIP , 40 + 130, 0xa0a0a0);
+  // Draw bars, one batch per color.
+  SDL_Rect bar[xy_cnt * XY_BINS];
+  SDL_SetRenderDrawBlendMode(renderer[POINT_SCREEN], SDL_BLENDMODE_ADD);
+  for(int c=0;c<num_colors;c++)
+    {
+      int num_bars = 0;
+      for(int i=0;i<xy_cnt;i++)
+	{
+	  uint32_t x0 = SCREEN_WIDTH[POINT_SCREEN] * i / xy_cnt;
+	  uint32_t y0 = SCREEN_HEIGHT[POINT_SCREEN] * (i+1) / xy_cnt;
+	  uint32_t * cnt = xx_count + ((size_t) c * xy_cnt + i) * XY_BINS;
+	  for(int b=0;b<XY_BINS;b++)
+	    {
+	      uint32_t bx = x0 + b * SCREEN_WIDTH[POINT_SCREEN] / (XY_BINS * xy_cnt);
+	      uint32_t bw = x0 + (b + 1) * SCREEN_WIDTH[POINT_SCREEN]
+		/ (XY_BINS * xy_cnt) - bx;
+	      uint32_t bh = (uint64_t) cnt[b] * SCREEN_HEIGHT[POINT_SCREEN]
+		/ (max_count[i] * xy_cnt);
+	      if (bh == 0) continue;
+	      bar[num_bars++] = (SDL_Rect) {bx, y0 - bh, bw, bh};
+	    }
 	}
+      uint32_t color_value = c_value[c];
+      int r = gamma_map[(color_value>>16) & 0xff];
+      int g = gamma_map[(color_value>>8) & 0xff];
+      int b = gamma_map[(color_value>>0) & 0xff];
+      SDL_SetRenderDrawColor(renderer[POINT_SCREEN],r,g,b,255);
+      SDL_RenderFillRects(renderer[POINT_SCREEN], bar, num_bars);
     }
-
-
-  // Text - selected color
-  char the_text[MAX_STRING];
-  SDL_Color white = {255, 255, 255};
-  SDL_Surface * text_surface;
-  sprintf(the_text, "%x", selected_color);
-  text_surface = TTF_RenderText_Solid(font, the_text, white);
-  if (text_surface == NULL) ERROR("TTF_RenderText_Solid failure");
-  blt_text(BRUSH_SCREEN, text_surface,
-	   SCREEN_WIDTH[BRUSH_SCREEN] - 2 * BRUSH_MODE_MARGIN -
-	   2 *BRUSH_MODE_BOX_SIZE, 40 + 130, 0xa0a0a0);
-  SDL_FreeSurface(text_surface);
-
-  // Pie-chart
-  uint64_t sorted_color[num_data];
-  for(int i=0;i<num_data;i++) sorted_color[i] =
-				(((uint64_t) get_color(color[i]) ) << 32) + hide[i];
-  qsort(sorted_color, num_data, sizeof(uint64_t), &cmp_int64);
-  for(int y=0;y<2*PIE_CHART_SIZE;y++)
-    for(int x=0;x<2*PIE_CHART_SIZE;x++)
-      {
-	int dx = x - PIE_CHART_SIZE;
-	int dy = y - PIE_CHART_SIZE;
-	int c = 0;
-        if (SQR(dx) + SQR(dy) >= SQR(PIE_CHART_SIZE)) continue;
-	uint64_t sc = sorted_color[(int)(num_data * (atan2(dy,dx) + M_PI)
-					 / (2 * M_PI + 0.0001))];
-	if (SQR(dx) + SQR(dy) >= SQR(3.0*PIE_CHART_SIZE/4.0)
-	    || !(sc & 0xffffffff)) c = sc >> 32;
-	point(BRUSH_SCREEN, x + PIE_CHART_X, y + PIE_CHART_Y) = c;	  
-      }
+  SDL_SetRenderDrawColor(renderer[POINT_SCREEN], 0,0,0,255);
+  free(slot_color);
+  free(rgb_slot);
+  free(c_value);
 }
 
-void xy_tally(int *xy_dim, int *xy_cnt)
+// Fisher-Yates shuffle of a[0..n-1]
+void shuffle(int * a, int n)
 {
-  for(int i=0;i<dim;i++)
+  for(int i=n-1;i>0;i--)
     {
-      if (box[i][3]) xy_dim[(*xy_cnt)++] = i;
+      int j = RANDOM(i + 1);
+      int t = a[i];
+      a[i] = a[j];
+      a[j] = t;
     }
 }
 
-void draw_point(int x, int y, unsigned c)
+// Shuffle 0..num_data-1 into perm, the order of perm_visible
+void perm_init(int num_data)
 {
-  SDL_Rect dst_rect = {x - point_size, y - point_size,
-		       point_surface->w, point_surface->h};
-  int r = gamma_map[(c>>16) & 0xff];
-  int g = gamma_map[(c>>8) & 0xff];
-  int b = gamma_map[(c>>0) & 0xff];
-  SDL_SetTextureColorMod(point_texture, r, g, b);
-  SDL_RenderCopy(renderer[POINT_SCREEN], point_texture, NULL, &dst_rect);
+  if ((perm = malloc(num_data * sizeof(int))) == NULL)
+    {fprintf(stderr, "Out of memory\n");exit(1);}
+  for(int k=0;k<num_data;k++) perm[k] = k;
+  shuffle(perm, num_data);
+  perm_drawn = perm_limit = 0;
 }
 
-void draw_xx_plot(int num_all_data, double (*data)[dim], int32_t * color,
-		  int32_t * hide, uint32_t i, int * xy_dim, uint32_t xy_cnt)
+// Set the frame rate the point budget aims for
+void mojave_set_fps(double fps)
 {
-  int32_t num_data = 0;
-  for(int k=0;k<num_all_data;k++) num_data+=!hide[k];
-  uint64_t sort_cb[num_data];
+  target_fps = fps < MIN_TARGET_FPS ? MIN_TARGET_FPS : fps;
+}
 
-  // Create and sort color/bin.
-  uint64_t index = 0;
-  for (int k=0; k<num_all_data;k++)
-    {
-      // Check if valid.
-      if (hide[k]) continue;
+double ms_since(Uint64 t0)
+{
+  return 1000.0 * (SDL_GetPerformanceCounter() - t0)
+    / SDL_GetPerformanceFrequency();
+}
 
-      // Get x value.
-      double x;
-      xy_transform(data[k], &x, &x, i, i, xy_dim, xy_cnt);
+// Fold the cost of a stage in this frame into its running mean
+void stage_note(int stage, double ms)
+{
+  stage_ms[stage] = 0.5 * (stage_ms[stage] + ms);
+  stage_frame_ms += ms;
+}
 
-      // Get bin from x.
-      double bin_float = (x - i * SCREEN_WIDTH[POINT_SCREEN] / xy_cnt);
-      bin_float *= (double)XY_BINS * xy_cnt / SCREEN_WIDTH[POINT_SCREEN];
-      uint32_t bin;      
-      if (bin_float < 0) bin = 0;
-      else if (bin_float >= XY_BINS) bin = XY_BINS - 1;
-      else bin = bin_float;
-      
-      // Record color bin.
-      sort_cb[index++] = ((uint64_t)get_color(color[k]) << 32) ^ bin;
+// Time left for the points in a frame, the controls and palette are only
+// redrawn for full refreshes
+double stage_budget(int more)
+{
+  double ms = 1000.0 / target_fps - stage_ms[STAGE_PROJ]
+    - stage_ms[STAGE_OTHER];
+  if (!more) ms -= stage_ms[STAGE_CONTROLS] + stage_ms[STAGE_PALETTE];
+  // Always some points, even if the rest of the frame is over budget
+  return ms < 250.0 / target_fps ? 250.0 / target_fps : ms;
+}
+
+// The slice [*m0, m1) of perm_visible to draw this frame, as much as the
+// budget allows. With more the last image is carried on, on top of it if the
+// splats can be kept and otherwise redrawn at least twice as far.
+int perm_slice(int more, int * m0)
+{
+  // Every d-th point rounded up, as a stride of d would draw
+  int d = decimation[decimation_mode];
+  perm_limit = (num_visible + d - 1) / d;
+  int64_t budget = perm_rate > 0.0 ? perm_rate * stage_budget(more)
+    : PERM_FIRST_SLICE;
+  if (budget < POOL_CHUNK) budget = POOL_CHUNK;
+  int64_t m1 = budget;
+  *m0 = 0;
+  if (more)
+    {
+      m1 = perm_drawn + budget;
+      if (hdr_on || render_mode == RENDER_MODE_SOFTWARE) *m0 = perm_drawn;
+      else if (m1 < 2 * (int64_t) perm_drawn) m1 = 2 * (int64_t) perm_drawn;
     }
-  qsort(sort_cb, num_data, sizeof(uint64_t), &cmp_int64);
-  
-  // Create counts.
-  // Count total number of colors.
-  int32_t color_count = 1;
-  for(int k=1;k<num_data;k++)
-    color_count += (sort_cb[k-1] >> 32) != (sort_cb[k] >> 32);
-  
-  // Prepare to count colors and bins (cb).
-  uint32_t cb_count[color_count][XY_BINS];
-  uint32_t c_value[color_count];
-  for(int c=0;c<color_count;c++)
-    for(int b=0;b<XY_BINS;b++)
-      cb_count[c][b] = 0;
-  
-  // Run through counting colors and bins (cb_count).
-  // Also store color values (c_value).
-  uint32_t cur_color_val = sort_cb[0] >> 32;
-  uint32_t cur_color_ind = 0;
-  for(int k=0;k<num_data;k++)
+  splat_keep = (*m0 > 0);
+  return m1 > perm_limit ? perm_limit : m1;
+}
+
+// Note how fast the slice [m0, m1) started at tick t0 was drawn
+void perm_done(int m0, int m1, Uint64 t0)
+{
+  double ms = ms_since(t0);
+  stage_note(STAGE_POINTS, ms);
+  if (m1 - m0 >= POOL_CHUNK && ms > 0.0)
     {
-      if (k && (sort_cb[k-1] >> 32) != (sort_cb[k] >> 32))
-	{
-	  cur_color_val = sort_cb[k] >> 32;
-	  cur_color_ind++;
-	}
-      uint32_t bin_num = sort_cb[k] & 0xffffffffUL;
-      cb_count[cur_color_ind][bin_num]++;
-      c_value[cur_color_ind] = cur_color_val;
+      double rate = (m1 - m0) / ms;
+      perm_rate = perm_rate > 0.0 ? 0.5 * (perm_rate + rate) : rate;
     }
-  
-  // Find maximum count.
-  uint32_t max_count = 1;
-  for(int c=0;c<color_count;c++)
-    for(int b=0;b<XY_BINS;b++)
-      {
-	if (cb_count[c][b] > max_count) max_count = cb_count[c][b];
-      }	      
-  
-  // Draw bars.
-  uint32_t x0 = SCREEN_WIDTH[POINT_SCREEN] * i / xy_cnt;
-  uint32_t y0 = SCREEN_HEIGHT[POINT_SCREEN] * (i+1) / xy_cnt;
-  uint32_t bin_x[XY_BINS + 1];
-  for(int b=0;b<XY_BINS + 1;b++)
-    bin_x[b] = x0 + b * SCREEN_WIDTH[POINT_SCREEN] / (XY_BINS * xy_cnt);
-  for(int c=0;c<color_count;c++)
-    for(int b=0;b<XY_BINS;b++)
-      {
-	uint32_t bx = bin_x[b];
-	uint32_t bw = bin_x[b+1] - bx;
-	uint32_t bh = cb_count[c][b] * SCREEN_HEIGHT[POINT_SCREEN]
-	  / (max_count * xy_cnt);
-	uint32_t by = y0  - bh;
-	SDL_Rect bar = {bx, by, bw, bh};
- 	uint32_t color_value = c_value[c];
-	int r = gamma_map[(color_value>>16) & 0xff];
-	int g = gamma_map[(color_value>>8) & 0xff];
-	int b = gamma_map[(color_value>>0) & 0xff];
-	SDL_SetRenderDrawBlendMode(renderer[POINT_SCREEN], SDL_BLENDMODE_ADD);
-	SDL_SetRenderDrawColor(renderer[POINT_SCREEN],r,g,b,255);
-	SDL_RenderFillRect(renderer[POINT_SCREEN], &bar);
-	SDL_SetRenderDrawColor(renderer[POINT_SCREEN], 0,0,0,255); 
-      }
+  perm_drawn = m1;
+}
+
+// Whether idle frames still have points to add
+int perm_pending()
+{
+  return perm_drawn < perm_limit;
 }
 
-// Draws the main view - points window
-void draw_points(int num_data, double (*data)[dim], int32_t * color, int32_t * hide)
+// Draws the main view - points window. refresh is the kind of refresh:
+// REFRESH_TONE when only the intensity changed, so in HDR and density modes
+// the sums of the last draw are just tone mapped again, and REFRESH_MORE to
+// add the next points of the permutation to the last image.
+void draw_points(int num_data, double (*data)[dim], int32_t * color,
+		 uint64_t * hide, int refresh)
 {
   int xy_dim[dim];
   int xy_cnt = 0;
   xy_tally(xy_dim, &xy_cnt);
+  display_update(color, num_data);
+  int tone_only = (refresh == REFRESH_TONE);
+  int more = (refresh == REFRESH_MORE);
+  int retone = tone_only && hdr_on && hdr_valid;
   
   // Draw points
   if (xy_cnt)
     {
-      // xy multiplot mode
-      for(int i=0;i<xy_cnt;i++)
-	for(int j=0;j<xy_cnt;j++)
-	  {
-	    // Check if we are plotting against itelf.
-	    if (i==j)
-	      {
-		// If so, draw histograms (xx_plot).
-		draw_xx_plot(num_data, data, color, hide, i, xy_dim, xy_cnt);
-		continue;
-	      }
-	    
-	    // Otherwise draw points for pairs (xy_plot).
-	    for(int k=0;k<num_data;k+=decimation[decimation_mode])
-	      {
-		if (hide[k]) continue;
-		double x,y;
-		xy_transform(data[k], &x, &y, i, j, xy_dim, xy_cnt);		
-		draw_point(x,y,get_color(color[k]));
-	      }
-	  }
+      // xy multiplot mode, the histograms count as projection
+      Uint64 t0 = SDL_GetPerformanceCounter();
+      visible_update(hide, num_data);
+      xy_stage(num_data, data, xy_dim, xy_cnt);
+      draw_xx_plots(num_data, color, xy_cnt, !retone && !more);
+      stage_note(STAGE_PROJ, ms_since(t0));
+
+      // Points for pairs (xy_plot), every off-diagonal cell of a point at once
+      if (retone) hdr_flush();
+      else
+	{
+	  int m0;
+	  int m1 = perm_slice(more, &m0);
+	  Uint64 t0 = SDL_GetPerformanceCounter();
+	  for(int m=m0;m<m1;m++)
+	    {
+	      int k = perm_visible[m];
+	      int16_t (*pixel)[2] = xy_pixel + (size_t) k * xy_cnt;
+	      unsigned c = display_color[k];
+	      for(int i=0;i<xy_cnt;i++)
+		for(int j=0;j<xy_cnt;j++)
+		  if (i != j) draw_point(pixel[i][0], pixel[j][1], c);
+	    }
+	  flush_points();
+	  perm_done(m0, m1, t0);
+	}
 
       // Draw grid
       SDL_SetRenderDrawColor(renderer[POINT_SCREEN],
@@ -889,15 +2656,38 @@ void draw_points(int num_data, double (*data)[dim], int32_t * color, int32_t * h
 	  }
       SDL_SetRenderDrawColor(renderer[POINT_SCREEN], 0,0,0,255);
     }
+  else if (density_mode != DENSITY_MODE_OFF)
+    {
+      // Density of the standard plot
+      Uint64 t0 = SDL_GetPerformanceCounter();
+      visible_update(hide, num_data);
+      proj_stage(num_data, data);
+      stage_note(STAGE_PROJ, ms_since(t0));
+      t0 = SDL_GetPerformanceCounter();
+      density_draw(tone_only);
+      stage_note(STAGE_POINTS, ms_since(t0));
+      perm_limit = perm_drawn;
+    }
   else
     {
       // Standard plot
-      for(int i=0; i < num_data; i+=decimation[decimation_mode])
+      Uint64 t0 = SDL_GetPerformanceCounter();
+      visible_update(hide, num_data);
+      proj_stage(num_data, data);
+      stage_note(STAGE_PROJ, ms_since(t0));
+      if (retone) hdr_flush();
+      else
 	{
-   	  if (hide[i]) continue;
-	  double x,y;
-	  transform(data[i], &x, &y);
-	  draw_point(x,y,get_color(color[i]));
+	  int m0;
+	  int m1 = perm_slice(more, &m0);
+	  Uint64 t0 = SDL_GetPerformanceCounter();
+	  for(int m=m0;m<m1;m++)
+	    {
+	      int i = perm_visible[m];
+	      draw_point(screen_x[i],screen_y[i],display_color[i]);
+	    }
+	  flush_points();
+	  perm_done(m0, m1, t0);
 	}
     }
 
@@ -925,89 +2715,96 @@ void draw_points(int num_data, double (*data)[dim], int32_t * color, int32_t * h
   SDL_RenderPresent(renderer[POINT_SCREEN]);
 }
 
-// Sets out to the identity
-void SO_clear(double * out)
+// Sets the frame A to the first 2 columns of the identity
+void frame_clear()
 {
+  active_valid = 0;
   for(int i=0;i<dim;i++)
-    for(int j=0;j<dim;j++)
-      out[AA(i,j)] = i==j;
+    for(int j=0;j<2;j++)
+      A[AF(i,j)] = i==j;
 }
 
-// Multiplies rotations matrices
-void SO_mult(double * out, double * A1, double * A2)
+// Gram-Schmidt on the 2 frame columns to stop rounding drift
+void frame_orthonormalize()
 {
-  double temp[SQR(dim)];
-  for(int i=0;i<dim;i++)
-    for(int j=0;j<dim;j++)
-      {
-	temp[AA(i,j)] = 0.0;
-	for(int k=0;k<dim;k++) temp[AA(i, j)] += A1[AA(i,k)] * A2[AA(k,j)];
+  active_valid = 0;
+  double sum2 = 0.0;
+  for(int i=0;i<dim;i++) sum2 += SQR(A[AF(i,0)]);
+  sum2 = sqrt(sum2);
+  for(int i=0;i<dim;i++) A[AF(i,0)] /= sum2;
+  double dot = 0.0;
+  for(int i=0;i<dim;i++) dot += A[AF(i,0)] * A[AF(i,1)];
+  for(int i=0;i<dim;i++) A[AF(i,1)] -= dot * A[AF(i,0)];
+  sum2 = 0.0;
+  for(int i=0;i<dim;i++) sum2 += SQR(A[AF(i,1)]);
+  sum2 = sqrt(sum2);
+  for(int i=0;i<dim;i++) A[AF(i,1)] /= sum2;
+}
+
+// Givens rotation of the frame by theta in the dim1/dim2 plane
+void frame_pair(int dim1, int dim2, double theta)
+{
+  double c = cos(theta);
+  double s = sin(theta);
+  active_valid = 0;
+  for(int j=0;j<2;j++)
+    {
+      double a1 = A[AF(dim1,j)];
+      double a2 = A[AF(dim2,j)];
+      A[AF(dim1,j)] = c * a1 - s * a2;
+      A[AF(dim2,j)] = s * a1 + c * a2;
     }
-  for(int i=0;i<dim;i++)
-    for(int j=0;j<dim;j++)
-      out[AA(i,j)] = temp[AA(i,j)];
 }
 
-// Inverts a rotation matrix (easy since it is just atranspose.)
-void SO_inverse(double *out, double *in)
+// Rotate A by theta in the dim1/dim2 plane, keeping the projection cache
+void rotate_pair(int dim1, int dim2, double theta)
 {
-  for(int i=0;i<dim;i++)
-    for(int j=0;j<dim;j++)
-      out[AA(i,j)] = in[AA(j,i)];
+  frame_pair(dim1, dim2, theta);
+  proj_rotate_pair(dim1, dim2, theta);
 }
 
-// Create a rotation matrix whiche rotates in the dim1/dim2 plane
-void SO_pair(double * out, int dim1, int dim2, double theta)
+// Apply Ry^dy = Q L^dy Q^T to the frame (dy need not be an integer)
+void rotate_ry(double dy)
 {
-  for(int i=0;i<dim;i++)
-    for(int j=0;j<dim;j++)
-      out[AA(i,j)] = (i==j);
-  out[AA(dim1,dim1)] = cos(theta);
-  out[AA(dim1,dim2)] = -sin(theta);
-  out[AA(dim2,dim1)] = sin(theta);
-  out[AA(dim2,dim2)] = cos(theta);
+  for(int k=0;k<ry_basis_count;k++)
+    frame_pair(ry_dim1[k], ry_dim2[k], -ry_theta[k]);
+  for(int k=ry_basis_count;k<ry_count;k++)
+    frame_pair(ry_dim1[k], ry_dim2[k], dy * ry_theta[k]);
+  for(int k=ry_basis_count-1;k>=0;k--)
+    frame_pair(ry_dim1[k], ry_dim2[k], ry_theta[k]);
+  proj_invalidate();
 }
 
-// Create powers of a rotation matrix to expedite special powers.
-void SO_powers(double * R)
+// Number of Givens layers used to mix n rotation dims in Q
+int ry_layers(int n)
 {
-  for(int i=1;i<R_POWERS;i++)
-    SO_mult(&R[i*dim*dim], &R[0], &R[(i-1)*dim*dim]);
+  int layers = RY_EXTRA_LAYERS;
+  while ((1 << (layers - RY_EXTRA_LAYERS)) < n) layers++;
+  return layers;
 }
 
-// Special power (using SO_powers)
-void SO_power(double *out, double *R, int power)
+void ry_append(int dim1, int dim2, double theta)
 {
-  SO_clear(out);
-  for(int i=0;i<R_POWERS;i++)
-    {
-      if ((power >> i) & 1) SO_mult(out,out,&R[i*dim*dim]);
-    }
+  ry_dim1[ry_count] = dim1;
+  ry_dim2[ry_count] = dim2;
+  ry_theta[ry_count] = theta;
+  ry_count++;
 }
 
-// Compute the dz-th power of Rz
-void rotate_dim(double * Rz, double * Rz_inv, int dz)
+// Rotate by Rx^dx Ry^dy, any real dx and dy
+void SO_rotate(double dx, double dy)
 {
-  double Z[SQR(dim)];
-  if (dz > 0)
-    {
-      SO_power(Z, Rz, dz);
-      SO_mult(A, Z, A);
-    }
-  else if (dz < 0)
+  if (dx) rotate_pair(rx_dim1, rx_dim2, dx * rx_theta);
+  if (dy) rotate_ry(dy);
+  // The rounding this removes is far below what the projection cache
+  // tolerates between full recomputes, so it does not invalidate it.
+  if ((dx || dy) && ++frame_steps >= FRAME_ORTHO_STEPS)
     {
-      SO_power(Z, Rz_inv, -dz);
-      SO_mult(A, Z, A);
+      frame_orthonormalize();
+      frame_steps = 0;
     }
 }
 
-// Rotate using dx and dy (powers)
-void SO_rotate(int dx, int dy)
-{
-  rotate_dim(Rx, Rx_inv, dx);
-  rotate_dim(Ry, Ry_inv, dy);
-}
-
 // Pick new rotation directions for dx and dy
 void new_rotation_direction(unsigned seed)
 {
@@ -1033,35 +2830,31 @@ void new_rotation_direction(unsigned seed)
       cnt += box[i][2];
     }
   double theta = (1.0-2.0*drand48()) * RX_THETA_MAX * rotation_speed;
-  SO_pair(&Rx[0], dim1, dim2, theta);
-  SO_powers(Rx);
-  SO_inverse(&Rx_inv[0], &Rx[0]); 
-  SO_powers(Rx_inv);
+  rx_dim1 = dim1;
+  rx_dim2 = dim2;
+  rx_theta = theta;
   
-  // Set up rotations Ry a bunch of pairs
-  SO_clear(&Ry[0]);
-  for(int k=0;k<SQR(dim);k++)
-    {
-      int ind_1 = RANDOM(cnt);
-      int ind_2 = RANDOM(cnt-1);
-      int dim1 = 0;
-      int dim2 = 0;
-      if (ind_2 >= ind_1) ind_2++;
-      cnt = 0;
-      for(int i=0;i<dim;i++)
-	{
-	  if (cnt == ind_1) dim1 = i;
-	  if (cnt == ind_2) dim2 = i;
-	  cnt += box[i][2];
-	}
-      double theta = (1.0-2.0*drand48()) * RY_THETA_MAX * rotation_speed;
-      double P[SQR(dim)];
-      SO_pair(P, dim1, dim2, theta);
-      SO_mult(&Ry[0], P, &Ry[0]);
-    }      
-  SO_powers(Ry);
-  SO_inverse(&Ry_inv[0], &Ry[0]); 
-  SO_powers(Ry_inv);
+  // Set up rotation Ry a random Q (layers of Givens rotations between
+  // shuffled pairs of rotation dims) around L (disjoint pairs, which commute).
+  int sel[cnt];
+  cnt = 0;
+  for(int i=0;i<dim;i++)
+    {
+      if (box[i][2]) sel[cnt++] = i;
+    }
+  ry_count = 0;
+  for(int l=0;l<ry_layers(cnt);l++)
+    {
+      shuffle(sel, cnt);
+      for(int i=0;i+1<cnt;i+=2) ry_append(sel[i], sel[i+1], 2 * M_PI * drand48());
+    }
+  ry_basis_count = ry_count;
+  // L pairs each dim with the next of the last layer's order, so that (for
+  // more than 2 dims) no plane of L is one of that layer's, which would
+  // commute with L and cancel in Q L Q^T
+  for(int i=1;i<cnt;i+=2)
+    ry_append(sel[i], sel[(i + 1) % cnt], (1.0-2.0*drand48()) * RY_THETA_MAX
+	      * rotation_speed * sqrt(cnt));
   
   // Set rotation direction flag
   rotation_direction_exists = 1;
@@ -1111,15 +2904,11 @@ void create_point_texture()
   point_texture = SDL_CreateTextureFromSurface(renderer[POINT_SCREEN],
 					       point_surface);
   SDL_SetTextureBlendMode(point_texture, SDL_BLENDMODE_ADD);
+  splat_kernel();
 }
 
-void set_gamma()
-{
-  for(int i=0;i<256;i++) gamma_map[i] = 256 * pow(i/256.0, gamma_correct);
-}
-
-// Move the slides given an (x,y) choice
-void move_sliders(int x, int y, int is_clicking)
+// Move the slides given an (x,y) choice, 1 if it was the intensity one
+int move_sliders(int x, int y, int is_clicking)
 {
   static int active_toggle;
   int middle_grove_x0 = (SPEED_GROVE_X + ZOOM_GROVE_X) / 2  - 40;
@@ -1156,7 +2945,9 @@ void move_sliders(int x, int y, int is_clicking)
       if (is_clicking) active_toggle = 4;
       gamma_correct = ratio;
       set_gamma();
+      return 1;
     }
+  return 0;
 }
 
 void create_text()
@@ -1204,18 +2995,19 @@ void service_box_0_1(int i, int bi)
       flag |= box[j][2];
       box[j][3] = box[j][2] = 0;
     }
-  if (flag) SO_clear(A);
+  proj_invalidate();
+  if (flag) frame_clear();
   if (!box[i][bi])
     {
       if (!box[i][!bi])
 	{
 	  box[i][bi] = 1;
-	  A[AA(i,bi)] = 1.0;
+	  A[AF(i,bi)] = 1.0;
 	  for(int j=0;j<dim;j++)
 	    {
 	      if (i!=j)
 		{
-		  A[AA(j,bi)] = 0;
+		  A[AF(j,bi)] = 0;
 		  box[j][bi] = 0;
 		}
 	    }
@@ -1228,13 +3020,13 @@ void service_box_0_1(int i, int bi)
 	      if (box[j][bi] == 1) break;
 	    }
 	  box[i][bi] = 1;
-	  A[AA(i,bi)] = 1.0;
+	  A[AF(i,bi)] = 1.0;
 	  box[i][!bi] = 0;
-	  A[AA(i,!bi)] = 0.0;
+	  A[AF(i,!bi)] = 0.0;
 	  box[j][bi] = 0;
-	  A[AA(j,bi)] = 0.0;
+	  A[AF(j,bi)] = 0.0;
 	  box[j][!bi] = 1;
-	  A[AA(j,!bi)] = 1.0;
+	  A[AF(j,!bi)] = 1.0;
 	}
     }				
 }
@@ -1244,11 +3036,12 @@ void service_box_2(int i, int bi)
   int cnt = 0;
   for(int j=0;j<dim;j++) cnt+=box[j][2];
   rotation_direction_exists = 0;
+  proj_invalidate();
   if ((cnt>1) | !box[i][bi])
     box[i][bi] = !box[i][bi];
   for(int j=0;j<dim;j++)
     {
-      A[AA(j,0)] = A[AA(j,1)] = 0.0;
+      A[AF(j,0)] = A[AF(j,1)] = 0.0;
       box[j][0] = box[j][1] = box[j][3] = 0;
     }
   double sum2 = 0.0;
@@ -1256,27 +3049,27 @@ void service_box_2(int i, int bi)
     {
       if (box[j][bi])
 	{
-	  A[AA(j,0)] = 1 - 2*drand48();
-	  sum2 += SQR(A[AA(j,0)]);
+	  A[AF(j,0)] = 1 - 2*drand48();
+	  sum2 += SQR(A[AF(j,0)]);
 	}
     }
   sum2 = sqrt(sum2);
-  for(int j=0;j<dim;j++) A[AA(j,0)] /= sum2;
+  for(int j=0;j<dim;j++) A[AF(j,0)] /= sum2;
   double dot = 0.0;
   for(int j=0;j<dim;j++)
     {
       if (box[j][bi])
 	{
-	  A[AA(j,1)] = 1 - 2*drand48();
-	  dot += A[AA(j,0)] * A[AA(j,1)];
+	  A[AF(j,1)] = 1 - 2*drand48();
+	  dot += A[AF(j,0)] * A[AF(j,1)];
 	}
     }
   for(int j=0;j<dim;j++)
-    A[AA(j,1)] -= dot * A[AA(j,0)];
+    A[AF(j,1)] -= dot * A[AF(j,0)];
   sum2 = 0.0;
-  for(int j=0;j<dim;j++) sum2 += SQR(A[AA(j,1)]);
+  for(int j=0;j<dim;j++) sum2 += SQR(A[AF(j,1)]);
   sum2 = sqrt(sum2);
-  for(int j=0;j<dim;j++) A[AA(j,1)] /= sum2;
+  for(int j=0;j<dim;j++) A[AF(j,1)] /= sum2;
 }
 
 void service_box_3(int i, int bi)
@@ -1301,66 +3094,409 @@ void clear_all()
   brush_color_mode = 0;
 }
 
-void undo_save(int num_data, int32_t undo[UNDO_SIZE][num_data],
-	       int32_t undo_hide[UNDO_SIZE][num_data],
-	       int32_t * color, int32_t * hide)
+// Record the old color/hide of point k, from worker w
+static inline void undo_record(int w, int k, int32_t color, int32_t hide)
 {
-  if (undo_length < UNDO_SIZE)
+  struct undo_buffer * buffer = &undo_worker[w];
+  if (buffer->length == buffer->capacity)
     {
-      int save_undo = 0;
-      if (undo_length == 0) save_undo = 1;
-      else
+      buffer->capacity = buffer->capacity ? 2 * buffer->capacity : 1024;
+      buffer->entry = realloc(buffer->entry,
+			      buffer->capacity * sizeof(struct undo_entry));
+      if (buffer->entry == NULL) {fprintf(stderr, "Out of memory\n");exit(1);}
+    }
+  buffer->entry[buffer->length++] = (struct undo_entry) {k, color, hide};
+}
+
+// Move the worker buffers into the open operation at the end of undo_log
+// Returns the number of entries moved, they end undo_log
+size_t undo_gather()
+{
+  size_t length = undo_log.length;
+  for(int w=0;w<MAX_WORKERS;w++) length += undo_worker[w].length;
+  if (length == undo_log.length) return 0;
+  size_t added = length - undo_log.length;
+
+  // A new edit drops everything that could have been redone
+  if (undo_top < undo_ops)
+    {
+      length -= undo_log.length - undo_op[undo_top];
+      undo_log.length = undo_op[undo_top];
+      undo_ops = undo_top;
+    }
+  if (length > undo_log.capacity)
+    {
+      while (length > undo_log.capacity)
+	undo_log.capacity = undo_log.capacity ? 2 * undo_log.capacity : 4096;
+      undo_log.entry = realloc(undo_log.entry,
+			       undo_log.capacity * sizeof(struct undo_entry));
+      if (undo_log.entry == NULL) {fprintf(stderr, "Out of memory\n");exit(1);}
+    }
+  for(int w=0;w<MAX_WORKERS;w++)
+    {
+      memcpy(undo_log.entry + undo_log.length, undo_worker[w].entry,
+	     undo_worker[w].length * sizeof(struct undo_entry));
+      undo_log.length += undo_worker[w].length;
+      undo_worker[w].length = 0;
+    }
+  return added;
+}
+
+// Refresh the display colors of the points in entry[0..m)
+void display_patch(struct undo_entry * entry, size_t m, int32_t * color)
+{
+  if (display_mode < 0) return;
+  for(size_t j=0;j<m;j++)
+    display_color[entry[j].index] = display_map(get_color(color[entry[j].index]));
+}
+
+// Update the visible list, color table and display colors for the edits
+// just gathered
+void undo_gather_edits(int32_t * color, uint64_t * hide, int num_data)
+{
+  size_t added = undo_gather();
+  struct undo_entry * entry = undo_log.entry + undo_log.length - added;
+  color_table_log(entry, added, color, hide);
+  visible_patch(hide, entry, added);
+  display_patch(entry, added, color);
+}
+
+// Close the open operation, if it changed anything
+void undo_commit()
+{
+  undo_gather();
+  size_t start = undo_top ? undo_op[undo_top] : 0;
+  if (undo_ops > undo_top || undo_log.length == start) return;
+  if (undo_ops + 2 > undo_op_capacity)
+    {
+      undo_op_capacity = undo_op_capacity ? 2 * undo_op_capacity : 256;
+      if ((undo_op = realloc(undo_op, undo_op_capacity * sizeof(size_t))) == NULL)
+	{fprintf(stderr, "Out of memory\n");exit(1);}
+    }
+  undo_op[0] = 0;
+  undo_ops = ++undo_top;
+  undo_op[undo_top] = undo_log.length;
+}
+
+// Swap the logged values of operation op with the current ones, in reverse
+// to undo and in order to redo (so repeated indices unwind correctly)
+void undo_swap(int op, int reverse, int32_t * color, uint64_t * hide)
+{
+  size_t n = undo_op[op + 1] - undo_op[op];
+  struct undo_entry * entry = undo_log.entry + undo_op[op];
+  for(size_t m=0;m<n;m++)
+    {
+      struct undo_entry * e = &entry[reverse ? n - 1 - m : m];
+      int32_t c = color[e->index];
+      int32_t h = HIDDEN(hide, e->index);
+      color_table_add(c, h, -1);
+      color_table_add(e->color, e->hide, 1);
+      color[e->index] = e->color;
+      if (e->hide) hide_set(hide, e->index);
+      else hide_clear(hide, e->index);
+      e->color = c;
+      e->hide = h;
+    }
+}
+
+void undo(int32_t * color, uint64_t * hide, int num_data)
+{
+  undo_commit();
+  if (undo_top == 0) return;
+  undo_top--;
+  undo_swap(undo_top, 1, color, hide);
+  visible_patch(hide, undo_log.entry + undo_op[undo_top],
+		undo_op[undo_top + 1] - undo_op[undo_top]);
+  display_patch(undo_log.entry + undo_op[undo_top],
+		undo_op[undo_top + 1] - undo_op[undo_top], color);
+}
+
+void redo(int32_t * color, uint64_t * hide, int num_data)
+{
+  undo_commit();
+  if (undo_top == undo_ops) return;
+  undo_swap(undo_top, 0, color, hide);
+  visible_patch(hide, undo_log.entry + undo_op[undo_top],
+		undo_op[undo_top + 1] - undo_op[undo_top]);
+  display_patch(undo_log.entry + undo_op[undo_top],
+		undo_op[undo_top + 1] - undo_op[undo_top], color);
+  undo_top++;
+}
+
+// Forget all operations
+void undo_clear()
+{
+  for(int w=0;w<MAX_WORKERS;w++) undo_worker[w].length = 0;
+  undo_log.length = 0;
+  undo_ops = undo_top = 0;
+}
+
+// Picks the color of the nearest visible point to the mouse, in x/y matrix
+// mode the nearest in the cell under the mouse
+void color_picker(int * mouse_x, int * mouse_y, double (*data)[dim],
+		  int * color, uint64_t * hide, int num_data)
+{
+  int xy_dim[dim];
+  int xy_cnt = 0;
+  xy_tally(xy_dim, &xy_cnt);
+  if (xy_cnt)
+    {
+      xy_stage(num_data, data, xy_dim, xy_cnt);
+      int i = *mouse_x * xy_cnt / SCREEN_HEIGHT[POINT_SCREEN];
+      int j = *mouse_y * xy_cnt / SCREEN_WIDTH[POINT_SCREEN];
+      i = i < 0 ? 0 : (i >= xy_cnt ? xy_cnt - 1 : i);
+      j = j < 0 ? 0 : (j >= xy_cnt ? xy_cnt - 1 : j);
+      grid_update(num_data, xy_col + (size_t) i * num_data,
+		  xy_col + (size_t) j * num_data,
+		  (i + 0.5) * SCREEN_HEIGHT[POINT_SCREEN] / xy_cnt,
+		  (j + 0.5) * SCREEN_WIDTH[POINT_SCREEN] / xy_cnt,
+		  xy_col_version, xy_col_zoom);
+    }
+  else
+    {
+      proj_stage(num_data, data);
+      grid_update(num_data, screen_x, screen_y, 0.0, 0.0,
+		  screen_version, screen_zoom);
+    }
+  int best = grid_nearest(*mouse_x, *mouse_y, hide);
+  unsigned best_color = (best >= 0) ? color[best] : 0x000000;
+  if (brush_color_mode == BRUSH_COLOR_MODE_DIRECT)
+    selected_color = (best_color >> mask_location) & 7;
+  else
+    selected_color = best_color;
+  printf("Brush color = %x\n", selected_color);
+}
+
+// Arguments of the brush job
+struct brush_job
+{
+  int num_data;
+  int * color;
+  uint64_t * hide;
+  int * index;
+  int inside;
+};
+
+// Brush point k
+static inline void brush_paint(int w, int k, int * color, uint64_t * hide)
+{
+  if (erase_mode_on)
+    {
+      if (HIDDEN(hide, k)) return;
+      undo_record(w, k, color[k], 0);
+      hide_set(hide, k);
+      return;
+    }
+  int c = color[k];
+  if (brush_color_mode == BRUSH_COLOR_MODE_DIRECT)
+    c = (c & ((7 << mask_location) ^ 0xffffffff))
+      ^ (selected_color << mask_location);
+  else
+    c = selected_color;
+  if (c == color[k]) return;
+  undo_record(w, k, color[k], 0);
+  color[k] = c;
+}
+
+void brush_range(int w, int k0, int k1, void * arg)
+{
+  struct brush_job * job = arg;
+  int * color = job->color;
+  uint64_t * hide = job->hide;
+  int x1 = (brush_xsize >= 0) ? brush_x : brush_x + brush_xsize;
+  int x2 = (brush_xsize < 0) ? brush_x : brush_x + brush_xsize;
+  int y1 = (brush_ysize >= 0) ? brush_y : brush_y + brush_ysize;
+  int y2 = (brush_ysize < 0) ? brush_y : brush_y + brush_ysize;
+  for(int m=k0;m<k1;m++)
+    {
+      int k = job->index ? job->index[m] : m;
+      if (HIDDEN(hide, k)) continue;
+      if (job->inside)
 	{
-	  for(int i = 0; i < num_data; i++)
-	    {
-	      if (color[i] != undo[undo_length - 1][i] ||
-		  hide[i] != undo_hide[undo_length - 1][i])
-		{
-		  save_undo = 1;
-		  break;
-		}
-	    }
+	  brush_paint(w, k, color, hide);
+	  continue;
+	}
+      if (screen_x[k] >= x1 && screen_x[k] < x2 &&
+	  screen_y[k] >= y1 && screen_y[k] < y2)
+	brush_paint(w, k, color, hide);
+    }
+}
+
+// Arguments of the x/y matrix brush job: for each of the num_rects brush
+// rectangles of a stroke, the cell columns and rows that meet it and the
+// column value range that lands inside it (rectangle s uses entries
+// s * xy_cnt on)
+struct brush_xy_job
+{
+  int num_data;
+  int * color;
+  uint64_t * hide;
+  int xy_cnt;
+  int num_rects;
+  int * num_cols;
+  int * num_rows;
+  int * col;
+  int * row;
+  float * col_lo;
+  float * col_hi;
+  float * row_lo;
+  float * row_hi;
+};
+
+// Smallest float u with (float) (origin + u) >= bound, so that the cached
+// columns can be compared directly, rounding exactly like the screen
+// coordinate (float) (cell centre + column)
+float xy_threshold(double origin, double bound)
+{
+  // Bisect rather than step, the floats near 0 are far too dense to walk
+  float u = bound - origin;
+  float d = 4 * FLT_EPSILON * (fabs(origin) + fabs(bound) + 1);
+  float lo = u - d, hi = u + d;
+  while ((float) (origin + lo) >= bound) lo -= d;
+  while ((float) (origin + hi) < bound) hi += d;
+  while (nextafterf(lo, INFINITY) < hi)
+    {
+      float mid = lo + 0.5f * (hi - lo);
+      if (mid <= lo || mid >= hi) mid = nextafterf(lo, INFINITY);
+      if ((float) (origin + mid) < bound) lo = mid;
+      else hi = mid;
+    }
+  return hi;
+}
+
+// Brush points k0..k1 (a multiple of 64 apart) 64 at a time, each block
+// tested against every rectangle of the stroke while it is in cache
+void brush_xy_range(int w, int k0, int k1, void * arg)
+{
+  struct brush_xy_job * job = arg;
+  for(int k=k0;k<k1;k+=64)
+    {
+      uint64_t visible_bits = ~job->hide[k >> 6];
+      if (!visible_bits) continue;
+      int n = (k1 - k < 64) ? k1 - k : 64;
+      uint64_t hit = 0;
+      for(int s=0;s<job->num_rects && hit != visible_bits;s++)
+	{
+	  int e = s * job->xy_cnt;
+	  uint64_t hit_x = 0, hit_y = 0;
+	  for(int c=e;c<e+job->num_cols[s];c++)
+	    hit_x |= range_mask(xy_col + (size_t) job->col[c] * job->num_data + k,
+				n, job->col_lo[c], job->col_hi[c]);
+	  hit_x &= visible_bits & ~hit;
+	  for(int r=e;hit_x && r<e+job->num_rows[s];r++)
+	    hit_y |= range_mask(xy_col + (size_t) job->row[r] * job->num_data + k,
+				n, job->row_lo[r], job->row_hi[r]);
+	  hit |= hit_x & hit_y;
 	}
-      if (save_undo)
+      while (hit)
+	{
+	  brush_paint(w, k + __builtin_ctzll(hit), job->color, job->hide);
+	  hit &= hit - 1;
+	}
+    }
+}
+
+// Brush the num_rects rectangles rect[s] = {x1, x2, y1, y2} in x/y matrix
+// mode in one pass, testing only the cells that meet each
+void brush_xy(int num_data, int * color, uint64_t * hide, int xy_cnt,
+	      int num_rects, int (*rect)[4])
+{
+  int n = num_rects * xy_cnt;
+  int * count;
+  int * index;
+  float * bound;
+  if ((count = malloc(2 * num_rects * sizeof(int))) == NULL)
+    {fprintf(stderr, "Out of memory\n");exit(1);}
+  if ((index = malloc(2 * n * sizeof(int))) == NULL)
+    {fprintf(stderr, "Out of memory\n");exit(1);}
+  if ((bound = malloc(4 * n * sizeof(float))) == NULL)
+    {fprintf(stderr, "Out of memory\n");exit(1);}
+  struct brush_xy_job job = {num_data, color, hide, xy_cnt, num_rects,
+			     count, count + num_rects, index, index + n,
+			     bound, bound + n, bound + 2 * n, bound + 3 * n};
+  double lim = 0.5 * SCREEN_WIDTH[POINT_SCREEN] / xy_cnt;
+  int any = 0;
+  for(int s=0;s<num_rects;s++)
+    {
+      int x1 = rect[s][0], x2 = rect[s][1], y1 = rect[s][2], y2 = rect[s][3];
+      int c = s * xy_cnt, r = s * xy_cnt;
+      for(int i=0;i<xy_cnt;i++)
 	{
-	  for(int i=0;i<num_data;i++)
+	  double x0 = (i + 0.5) * SCREEN_HEIGHT[POINT_SCREEN] / xy_cnt;
+	  double y0 = (i + 0.5) * SCREEN_WIDTH[POINT_SCREEN] / xy_cnt;
+	  // Columns lie within +-lim of their cell centre, give or take rounding
+	  if (x0 + lim + 1 >= x1 && x0 - lim - 1 < x2)
+	    {
+	      job.col[c] = i;
+	      job.col_lo[c] = xy_threshold(x0, x1);
+	      job.col_hi[c++] = xy_threshold(x0, x2);
+	    }
+	  if (y0 + lim + 1 >= y1 && y0 - lim - 1 < y2)
 	    {
-	      undo[undo_length][i] = color[i];
-	      undo_hide[undo_length][i] = hide[i];
+	      job.row[r] = i;
+	      job.row_lo[r] = xy_threshold(y0, y1);
+	      job.row_hi[r++] = xy_threshold(y0, y2);
 	    }
-	  undo_length++;
-	  max_undo_length = undo_length;
 	}
+      job.num_cols[s] = c - s * xy_cnt;
+      job.num_rows[s] = r - s * xy_cnt;
+      if (job.num_cols[s] && job.num_rows[s]) any = 1;
     }
+  if (any) pool_for(num_data, brush_xy_range, &job);
+  free(count);
+  free(index);
+  free(bound);
 }
 
-void color_picker(int * mouse_x, int * mouse_y, double (*data)[dim],
-		  int * color, int num_data)
-//void color_picker(double (*data)[dim], int * color, int num_data)
-{
-  double min_dist_sqr = INFINITY;
-  unsigned best_color = 0x000000;
-  for(int i = 0; i < num_data; i++)
-    {
-      double trans_x, trans_y;
-      transform(data[i], &trans_x, &trans_y);
-      double this_dist_sqr = SQR(trans_x - *mouse_x) +
-	SQR(trans_y - *mouse_y);
-      if (this_dist_sqr < min_dist_sqr)
+// Hide every point of the selected color
+void hide_color_range(int w, int k0, int k1, void * arg)
+{
+  struct brush_job * job = arg;
+  for(int m=k0;m<k1;m++)
+    {
+      int i = job->index[m];
+      int c = job->color[i];
+      if (brush_color_mode == BRUSH_COLOR_MODE_DIRECT)
+	c = (c >> mask_location) & 7;
+      if (c != selected_color) continue;
+      undo_record(w, i, job->color[i], 0);
+      hide_set(job->hide, i);
+    }
+}
+
+// Show every point
+void unhide_range(int w, int k0, int k1, void * arg)
+{
+  struct brush_job * job = arg;
+  for(int i=k0;i<k1;i++)
+    {
+      // Whole words of visible points at once
+      if (!(i & 63) && i + 64 <= k1 && !job->hide[i >> 6])
 	{
-	  min_dist_sqr = this_dist_sqr;
-	  best_color = color[i];
+	  i += 63;
+	  continue;
 	}
+      if (!HIDDEN(job->hide, i)) continue;
+      undo_record(w, i, job->color[i], 1);
+      hide_clear(job->hide, i);
     }
-  if (brush_color_mode == BRUSH_COLOR_MODE_DIRECT)
-    selected_color = (best_color >> mask_location) & 7;
-  else
-    selected_color = best_color;
-  printf("Brush color = %x\n", selected_color);
 }
 
-void service_left_button_on_point(int mouse_x, int mouse_y, double (*data)[dim],
-				 int * color, int * hide, int num_data)
+// Brush grid cells c1..c2 of row cy, inside means they lie within the brush
+void brush_cells(struct brush_job * job, int cy, int c1, int c2, int inside)
+{
+  if (c1 > c2) return;
+  int s = grid_start[cy * grid_w + c1];
+  job->index = grid_index + s;
+  job->inside = inside;
+  pool_for(grid_start[cy * grid_w + c2 + 1] - s, brush_range, job);
+}
+
+// Brush at the mouse, or with steps > 1 at that many points along the path
+// from stroke_x, stroke_y to it
+void service_left_button_on_point(int mouse_x, int mouse_y, int steps,
+				  double (*data)[dim], int * color,
+				  uint64_t * hide, int num_data)
 {
   if (SDL_GetModState() & KMOD_CTRL)
     {
@@ -1382,64 +3518,86 @@ void service_left_button_on_point(int mouse_x, int mouse_y, double (*data)[dim],
       int xy_dim[dim];
       int xy_cnt = 0;
       xy_tally(xy_dim, &xy_cnt);
-      brush_x = mouse_x - brush_xsize;
-      brush_y = mouse_y - brush_ysize;
-      for(int k=0;k<num_data;k++)
+      struct brush_job job = {num_data, color, hide, NULL, 0};
+      int (*rect)[4];
+      if ((rect = malloc(steps * sizeof(*rect))) == NULL)
+	{fprintf(stderr, "Out of memory\n");exit(1);}
+      for(int s=1;s<=steps;s++)
 	{
-	  if (hide[k]) continue;
-	  double out_points[dim*dim][2];
-	  int num_out_points = 0;
-	  if (xy_cnt)
-	    {
-	      for(int i=0;i<xy_cnt;i++)
-		for(int j=0;j<xy_cnt;j++)
-		  {
-		    xy_transform(data[k], &out_points[num_out_points][0],
-				 &out_points[num_out_points][1], i, j, xy_dim,
-				 xy_cnt);			
-		    num_out_points++;		       
-		  }
-	    }
-	  else
-	    {
-	      transform(data[k], &out_points[0][0], &out_points[0][1]);
-	      num_out_points++;
-	    }
-	  
-	  for(int l=0;l<num_out_points;l++)
+	  int x = (steps == 1) ? mouse_x
+	    : stroke_x + (mouse_x - stroke_x) * s / steps;
+	  int y = (steps == 1) ? mouse_y
+	    : stroke_y + (mouse_y - stroke_y) * s / steps;
+	  brush_x = x - brush_xsize;
+	  brush_y = y - brush_ysize;
+	  rect[s - 1][0] = (brush_xsize >= 0) ? brush_x : brush_x + brush_xsize;
+	  rect[s - 1][1] = (brush_xsize < 0) ? brush_x : brush_x + brush_xsize;
+	  rect[s - 1][2] = (brush_ysize >= 0) ? brush_y : brush_y + brush_ysize;
+	  rect[s - 1][3] = (brush_ysize < 0) ? brush_y : brush_y + brush_ysize;
+	}
+      if (xy_cnt)
+	{
+	  // One pass over the points for the whole stroke
+	  xy_stage(num_data, data, xy_dim, xy_cnt);
+	  brush_xy(num_data, color, hide, xy_cnt, steps, rect);
+	  undo_gather_edits(color, hide, num_data);
+	  free(rect);
+	  return;
+	}
+
+      // Only the grid cells under the brush, each row of them is contiguous
+      proj_stage(num_data, data);
+      grid_update(num_data, screen_x, screen_y, 0.0, 0.0,
+		  screen_version, screen_zoom);
+      for(int s=0;s<steps;s++)
+	{
+	  int x1 = rect[s][0], x2 = rect[s][1], y1 = rect[s][2], y2 = rect[s][3];
+	  if (x1 < 0) x1 = 0;
+	  if (y1 < 0) y1 = 0;
+	  if (x2 > grid_w << GRID_SHIFT) x2 = grid_w << GRID_SHIFT;
+	  if (y2 > grid_h << GRID_SHIFT) y2 = grid_h << GRID_SHIFT;
+	  if (x1 >= x2 || y1 >= y2) continue;
+	  int cx1 = x1 >> GRID_SHIFT, cx2 = (x2 - 1) >> GRID_SHIFT;
+	  // Cells ix1..ix2 of a row are inside the brush horizontally
+	  int ix1 = (x1 + (1 << GRID_SHIFT) - 1) >> GRID_SHIFT;
+	  int ix2 = (x2 >> GRID_SHIFT) - 1;
+	  for(int cy=y1 >> GRID_SHIFT;cy<=(y2 - 1) >> GRID_SHIFT;cy++)
 	    {
-	      double x = out_points[l][0];
-	      double y = out_points[l][1];
-	      int x1 = (brush_xsize >= 0)
-		? brush_x : brush_x + brush_xsize;
-	      int x2 = (brush_xsize < 0)
-		? brush_x : brush_x + brush_xsize;
-	      int y1 = (brush_ysize >= 0)
-		? brush_y : brush_y + brush_ysize;
-	      int y2 = (brush_ysize < 0)
-		? brush_y : brush_y + brush_ysize;
-	      if (x >= x1 && x < x2 && y >= y1 && y < y2)
+	      if (cy << GRID_SHIFT >= y1 && (cy + 1) << GRID_SHIFT <= y2
+		  && ix1 <= ix2)
 		{
-		  if (erase_mode_on)
-		    hide[k] = 1;
-		  else if (brush_color_mode == BRUSH_COLOR_MODE_DIRECT)
-		    color[k] = (color[k] &
-				((7 << mask_location) ^ 0xffffffff))
-		      ^ (selected_color << mask_location);
-		  else
-		    color[k] = selected_color;
+		  brush_cells(&job, cy, cx1, ix1 - 1, 0);
+		  brush_cells(&job, cy, ix1, ix2, 1);
+		  brush_cells(&job, cy, ix2 + 1, cx2, 0);
 		}
+	      else brush_cells(&job, cy, cx1, cx2, 0);
 	    }
 	}
+      free(rect);
+      undo_gather_edits(color, hide, num_data);
     }
 }
 
 void service_mouse_motion_on_point(int mouse_x, int mouse_y, int mouse_state,
-				   double (*data)[dim], int * color, int * hide,
+				   double (*data)[dim], int * color, uint64_t * hide,
 				   int num_data)
 {
   if (mouse_state & SDL_BUTTON_LMASK)
-    service_left_button_on_point(mouse_x, mouse_y, data, color, hide, num_data);
+    {
+      // Brush the whole path since the last motion, in steps of at most
+      // half the brush so fast strokes leave no gaps
+      int steps = 1;
+      if (stroke_x >= 0 && !(SDL_GetModState() & KMOD_CTRL))
+	{
+	  int sx = 2 * abs(mouse_x - stroke_x) / (abs(brush_xsize) + 1);
+	  int sy = 2 * abs(mouse_y - stroke_y) / (abs(brush_ysize) + 1);
+	  steps = 1 + (sx > sy ? sx : sy);
+	}
+      service_left_button_on_point(mouse_x, mouse_y, steps,
+				   data, color, hide, num_data);
+      stroke_x = mouse_x;
+      stroke_y = mouse_y;
+    }
   if (mouse_state & SDL_BUTTON_RMASK)
     {
       brush_x = OFFSCREEN;
@@ -1450,9 +3608,8 @@ void service_mouse_motion_on_point(int mouse_x, int mouse_y, int mouse_state,
 	new_rotation_direction(RANDOM_SEED);
       if (last_mouse_x >= 0 && last_mouse_y >= 0)
 	{
-	  int dx = mouse_x - last_mouse_x;
-	  int dy = mouse_y - last_mouse_y;
-	  SO_rotate(dx,dy);
+	  motion_dx += mouse_x - last_mouse_x;
+	  motion_dy += mouse_y - last_mouse_y;
 	}		      
       last_mouse_x = mouse_x;
       last_mouse_y = mouse_y;
@@ -1492,14 +3649,15 @@ void service_left_button_on_brush(int button_x, int button_y, double (*data)[dim
       int dy = button_y - (PIE_CHART_Y + PIE_CHART_SIZE);
       if (SQR(dx) + SQR(dy) < SQR(PIE_CHART_SIZE))
 	{
-	  uint64_t sorted_color[num_data];
-	  for(int i=0;i<num_data;i++) sorted_color[i] =
-					(((uint64_t) get_color(color[i]) ) << 32)
-					+ color[i];
-	  qsort(sorted_color, num_data, sizeof(uint64_t), &cmp_int64);
-	  uint32_t sc = sorted_color[(int)(num_data * (atan2(dy,dx) + M_PI)
-					   / (2 * M_PI + 0.0001))] & 0xffffffff;
-	  selected_color = sc;
+	  struct pie_slice * slice;
+	  if ((slice = malloc(color_table_used * sizeof(struct pie_slice))) == NULL)
+	    {fprintf(stderr, "Out of memory\n");exit(1);}
+	  int num_slices = pie_slices(slice);
+	  if (num_slices)
+	    selected_color = pie_find(slice, num_slices,
+				      (int)(num_data * (atan2(dy,dx) + M_PI)
+					    / (2 * M_PI + 0.0001)))->label;
+	  free(slice);
 	}
     }
   else if (button_x >= SCREEN_WIDTH[BRUSH_SCREEN]
@@ -1587,13 +3745,23 @@ void mojave(double * data_flat, int32_t * color, int num_data, int dim_in,
 {
   set_gamma();
   
-  int32_t * hide;
-  if ((hide = malloc(sizeof(int32_t) * num_data)) == 0)
+  uint64_t * hide;
+  if ((hide = malloc(sizeof(uint64_t) * ((num_data + 63) >> 6))) == 0)
     {
       fprintf(stderr, "Out of memory\n");
       exit(1);
     }
-  for(int i=0;i<num_data;i++) hide[i] = 0;
+  hide_reset(hide, num_data);
+  color_table_build(color, hide, num_data);
+  if ((visible = malloc(sizeof(int) * num_data)) == NULL)
+    {fprintf(stderr, "Out of memory\n");exit(1);}
+  if ((perm_visible = malloc(sizeof(int) * num_data)) == NULL)
+    {fprintf(stderr, "Out of memory\n");exit(1);}
+  visible_valid = 0;
+  if ((display_color = malloc(sizeof(uint32_t) * num_data)) == NULL)
+    {fprintf(stderr, "Out of memory\n");exit(1);}
+  display_invalidate();
+  perm_init(num_data);
 
   if (TTF_Init()) {fprintf(stderr, "TTF_Init error!");exit(1);}
   int font_found = 0;
@@ -1619,46 +3787,54 @@ void mojave(double * data_flat, int32_t * color, int num_data, int dim_in,
   if (dim <= 1) return;
   double (*data)[dim] = (double (*)[dim]) data_flat;
 
-  int32_t * undo_flat;
-  if ((undo_flat = malloc(sizeof(int32_t) * num_data * UNDO_SIZE)) == 0)
-    {
-      fprintf(stderr, "Out of memory\n");
-      exit(1);
-    }
-  int32_t * undo_hide_flat;
-  if ((undo_hide_flat = malloc(sizeof(int32_t) * num_data * UNDO_SIZE)) == 0)
-    {
-      fprintf(stderr, "Out of memory\n");
-      exit(1);
-    }
-  int32_t (*undo)[num_data] = (int32_t (*)[num_data]) undo_flat;
-  int32_t (*undo_hide)[num_data] = (int32_t (*)[num_data]) undo_hide_flat;
-  for(int i=0;i<num_data;i++) undo[0][i] = color[i];
-  for(int i=0;i<num_data;i++) undo_hide[0][i] = 0;//hide[i];
+  undo_clear();
 
-  // Set up initial transform (A) \in SO(dim)
-  if ((A = malloc(SQR(dim) * sizeof(double))) == NULL)
+  // Set up initial transform (A), the first 2 columns of SO(dim)
+  if ((A = malloc(2 * dim * sizeof(double))) == NULL)
     {fprintf(stderr, "Out of memory\n");exit(1);}  
-  for(int y=0;y<dim;y++)
-    for(int i=0;i<dim;i++)
-      A[AA(y,i)] = (i==y);
+  if ((active_dim = malloc(dim * sizeof(int))) == NULL)
+    {fprintf(stderr, "Out of memory\n");exit(1);}
+  if ((active_a0 = malloc(dim * sizeof(double))) == NULL)
+    {fprintf(stderr, "Out of memory\n");exit(1);}
+  if ((active_a1 = malloc(dim * sizeof(double))) == NULL)
+    {fprintf(stderr, "Out of memory\n");exit(1);}
+  frame_clear();
+  if ((proj_x = malloc(num_data * sizeof(double))) == NULL)
+    {fprintf(stderr, "Out of memory\n");exit(1);}
+  if ((proj_y = malloc(num_data * sizeof(double))) == NULL)
+    {fprintf(stderr, "Out of memory\n");exit(1);}
+  if ((screen_x = malloc(num_data * sizeof(float))) == NULL)
+    {fprintf(stderr, "Out of memory\n");exit(1);}
+  if ((screen_y = malloc(num_data * sizeof(float))) == NULL)
+    {fprintf(stderr, "Out of memory\n");exit(1);}
+  proj_invalidate();
+  if ((xy_col_dim = malloc(dim * sizeof(int))) == NULL)
+    {fprintf(stderr, "Out of memory\n");exit(1);}
+  free(xy_col);
+  free(xy_pixel);
+  xy_col = NULL;
+  xy_pixel = NULL;
+  xy_col_cnt = xy_col_capacity = 0;
+  grid_w = (SCREEN_WIDTH[POINT_SCREEN] >> GRID_SHIFT) + 1;
+  grid_h = (SCREEN_HEIGHT[POINT_SCREEN] >> GRID_SHIFT) + 1;
+  if ((grid_index = malloc(num_data * sizeof(int))) == NULL)
+    {fprintf(stderr, "Out of memory\n");exit(1);}
+  if ((grid_start = malloc((grid_w * grid_h + 1) * sizeof(int))) == NULL)
+    {fprintf(stderr, "Out of memory\n");exit(1);}
+  if ((grid_count = malloc(MAX_WORKERS * grid_w * grid_h * sizeof(int))) == NULL)
+    {fprintf(stderr, "Out of memory\n");exit(1);}
+  grid_px = grid_py = NULL;
+  grid_version = 0;
 
-  // Set up initial rotations (R,R_inv)
-  if ((Rx = malloc(R_POWERS * SQR(dim) * sizeof(double))) == NULL)
-    {fprintf(stderr, "Out of memory\n");exit(1);}  
-  if ((Rx_inv = malloc(R_POWERS * SQR(dim) * sizeof(double))) == NULL)
+  // Set up initial rotation (Ry, the identity until a direction is picked)
+  int ry_max = (ry_layers(dim) + 1) * (dim / 2);
+  if ((ry_dim1 = malloc(ry_max * sizeof(int))) == NULL)
     {fprintf(stderr, "Out of memory\n");exit(1);}
-  if ((Ry = malloc(R_POWERS * SQR(dim) * sizeof(double))) == NULL)
-    {fprintf(stderr, "Out of memory\n");exit(1);}  
-  if ((Ry_inv = malloc(R_POWERS * SQR(dim) * sizeof(double))) == NULL)
+  if ((ry_dim2 = malloc(ry_max * sizeof(int))) == NULL)
     {fprintf(stderr, "Out of memory\n");exit(1);}
-  for(int k=0;k<R_POWERS;k++)
-    for(int y=0;y<dim;y++)
-      for(int i=0;i<dim;i++)
-	{
-	  Rx_inv[RR(k,y,i)] = Rx[RR(k,y,i)] = (i==y);
-	  Ry_inv[RR(k,y,i)] = Ry[RR(k,y,i)] = (i==y);
-	}
+  if ((ry_theta = malloc(ry_max * sizeof(double))) == NULL)
+    {fprintf(stderr, "Out of memory\n");exit(1);}
+  ry_basis_count = ry_count = 0;
 
   // Set up initial controls (boxes)
   if ((box = malloc(dim * CONTROL_NUM_BOX * sizeof(int))) == NULL)
@@ -1719,6 +3895,9 @@ void mojave(double * data_flat, int32_t * color, int num_data, int dim_in,
     ERROR("SDL_LoadBMP (logo)");
 
   create_point_texture();
+  batch_init();
+  simd_init();
+  pool_init();
   
   SDL_Event event;
   int flag = 1;
@@ -1726,36 +3905,16 @@ void mojave(double * data_flat, int32_t * color, int num_data, int dim_in,
   int mouse_x, mouse_y;
   unsigned frame_time = 0;
   int mouse_motion_occured = 0;
+  Uint64 rotation_tick = SDL_GetPerformanceCounter();
   while(flag)
     {
       unsigned frame_start = SDL_GetTicks();
+      Uint64 frame_tick = SDL_GetPerformanceCounter();
+      stage_frame_ms = 0.0;
 
-      // Non-event driven rotation
-      if (rotation_mode & !mouse_motion_occured)
-	{
-	  SO_rotate(KEYBOARD_ROTATION_DX, KEYBOARD_ROTATION_DY);
-	  refresh_flag = 1;
-	}
-      
-      // Refresh logic
-      if (refresh_flag)
-	{
-	  // Point Screen	  
-          SDL_RenderClear(renderer[POINT_SCREEN]);
-          draw_points(num_data, data, color, hide);
-
-	  // Control screen
-	  draw_controls();
-	  refresh(CONTROL_SCREEN);
-
-	  // Brush screen
-	  draw_palette(num_data, data, color, hide);
-	  refresh(BRUSH_SCREEN);
-	}
-      refresh_flag = 0;
+      // Drain every pending event, coalescing the mouse motions
       mouse_motion_occured = 0;
-      // Event loop, suppress mouse motions.
-      if (SDL_PollEvent(&event))
+      while (SDL_PollEvent(&event))
 	{
 	  switch(event.type)
 	    {
@@ -1778,6 +3937,11 @@ void mojave(double * data_flat, int32_t * color, int num_data, int dim_in,
 		  if (++decimation_mode == MAX_DECIMATION_MODE) decimation_mode = 0;
 		  refresh_flag = 1;
 		  break;
+		case SDLK_g:
+		  if (++render_mode == RENDER_MODES) render_mode = 0;
+		  printf("Render path = %s\n", render_mode_name[render_mode]);
+		  refresh_flag = 1;
+		  break;
 		case SDLK_x:
 		  for(int i = 0; i < dim; i++)
 		    {
@@ -1789,20 +3953,26 @@ void mojave(double * data_flat, int32_t * color, int num_data, int dim_in,
 		    }
 		  refresh_flag = 1;
 		  break;
+		case SDLK_l:
+		  hdr_on = !hdr_on;
+		  hdr_valid = 0;
+		  printf("HDR = %s\n", hdr_on ? "on" : "off");
+		  refresh_flag = 1;
+		  break;
+		case SDLK_v:
+		  if (++density_mode == DENSITY_MODES) density_mode = 0;
+		  density_valid = 0;
+		  printf("Density view = %s\n", density_mode_name[density_mode]);
+		  refresh_flag = 1;
+		  break;
 		case SDLK_h:
-		  for(int i=0;i<num_data;i++)
-		    {
-		      if (brush_color_mode == BRUSH_COLOR_MODE_DIRECT)
-			{
-			  if (((color[i] >> mask_location) & 7) == selected_color)
-			    hide[i] = 1;
-			}
-		      else {
-			{
-			  if (color[i] == selected_color) hide[i] = 1;
-			}
-		      }
-		    }
+		  {
+		    visible_update(hide, num_data);
+		    struct brush_job job = {num_data, color, hide, visible};
+		    pool_for(num_visible, hide_color_range, &job);
+		    undo_gather_edits(color, hide, num_data);
+		    undo_commit();
+		  }
 		  refresh_flag = 1;
 		  break;
 		case SDLK_c:
@@ -1810,22 +3980,34 @@ void mojave(double * data_flat, int32_t * color, int num_data, int dim_in,
 		  refresh_flag = 1;
 		  break;
 		case SDLK_SPACE:
-		  for(int i=0;i<num_data;i++) hide[i] = 0;
+		  {
+		    struct brush_job job = {num_data, color, hide};
+		    pool_for(num_data, unhide_range, &job);
+		    undo_gather_edits(color, hide, num_data);
+		    undo_commit();
+		  }
 		  new_rotation_direction(RANDOM_SEED);
 		  refresh_flag = 1;
 		  break;
 		case SDLK_s:
 		  for(int i=0;i<dim;i++) box[i][0] = box[i][1] = box[i][2] = 0;
-		  for(int i=0;i<num_data;i++) hide[i] = 0;
+		  {
+		    struct brush_job job = {num_data, color, hide};
+		    pool_for(num_data, unhide_range, &job);
+		    undo_gather_edits(color, hide, num_data);
+		    undo_commit();
+		  }
 		  box[0][0] = 1;
 		  box[1][1] = 1;
 		  clear_all();
-		  SO_clear(A);
+		  frame_clear();
+		  proj_invalidate();
 		  rotation_mode = 0;
 		  zoom_ratio = 1.0;
 		  rotation_speed = 1.0;
 		  point_size = DEFAULT_POINT_SIZE;
 		  gamma_correct = 1.0;
+		  set_gamma();
 		  refresh_flag = 1;
 		  break;
 		case SDLK_r:
@@ -1841,12 +4023,7 @@ void mojave(double * data_flat, int32_t * color, int num_data, int dim_in,
 		case SDLK_n:
 		  if (brush_color_mode != BRUSH_COLOR_MODE_DIRECT)
 		    {
-		      int max_color = 0;
-		      for(int i=0;i<num_data;i++)
-			{
-			  if (color[i] > max_color) max_color = color[i];
-			}
-		      selected_color = max_color + 1;
+		      selected_color = color_table_max() + 1;
 		      refresh_flag = 1;
 		    }
 		  break;
@@ -1856,8 +4033,8 @@ void mojave(double * data_flat, int32_t * color, int num_data, int dim_in,
 		  if (event.window.windowID ==
 		      SDL_GetWindowID(screen[POINT_SCREEN]))
 		    {		      
-		      color_picker(&mouse_x, &mouse_y, data, color, num_data);
-		      //color_picker(data, color, num_data);
+		      color_picker(&mouse_x, &mouse_y, data, color, hide,
+				   num_data);
 		      refresh_flag = 1;
 		    }
 		  break;
@@ -1866,6 +4043,14 @@ void mojave(double * data_flat, int32_t * color, int num_data, int dim_in,
 			 1000.0 / frame_time);
 		  printf("Current color = %08x\n", selected_color);
 		  printf("Data size = (%d, %d)\n", num_data, dim);
+		  printf("Render path = %s\n", render_mode_name[render_mode]);
+		  printf("HDR = %s\n", hdr_on ? "on" : "off");
+		  printf("Target frame rate is %6.02f fps, frame costs (ms):",
+			 target_fps);
+		  for(int i=0;i<STAGES;i++)
+		    printf(" %s %.2f", stage_name[i], stage_ms[i]);
+		  printf("\nDrawing %d of %d visible points a frame in motion\n",
+			 (int) (perm_rate * stage_budget(0)), num_visible);
 		  break;
 		case SDLK_DOWN:
 		  control_scroll += CONTROL_SCROLL_DELTA;
@@ -1914,28 +4099,12 @@ void mojave(double * data_flat, int32_t * color, int num_data, int dim_in,
 		  refresh_flag = 1;
 		  break;
 		case SDLK_z:
-		  if (undo_length > 1)
-		    {
-		      undo_length--;
-		      for(int i=0;i<num_data;i++)
-			{
-			  color[i] = undo[undo_length-1][i];
-			  hide[i] = undo_hide[undo_length-1][i];
-			}
-		      refresh_flag = 1;
-		    }
+		  undo(color, hide, num_data);
+		  refresh_flag = 1;
 		  break;
 		case SDLK_y:
-		  if (undo_length < UNDO_SIZE && undo_length < max_undo_length)
-		    {
-		      for(int i=0;i<num_data;i++)
-			{
-			  color[i] = undo[undo_length][i];
-			  hide[i] = undo_hide[undo_length][i];
-			}
-		      undo_length++;
-		      refresh_flag = 1;
-		    }
+		  redo(color, hide, num_data);
+		  refresh_flag = 1;
 		  break;
 		case SDLK_MINUS:
 		  zoom_ratio /= POINT_ZOOM_MULT;
@@ -1970,20 +4139,17 @@ void mojave(double * data_flat, int32_t * color, int num_data, int dim_in,
 		case SDLK_SEMICOLON:
 		  gamma_correct *= 1.05;
 		  set_gamma();
-		  refresh_flag = 1;
+		  if (!refresh_flag) refresh_flag = REFRESH_TONE;
 		  break;
 		case SDLK_QUOTE:
 		  gamma_correct /= 1.05;
 		  set_gamma();
-		  refresh_flag = 1;
+		  if (!refresh_flag) refresh_flag = REFRESH_TONE;
 		  break;
 		}
+	      break;
 	    case SDL_MOUSEMOTION:
-	      if (frame_time != 0)
-		{
-		  mouse_motion_occured = 1;
-		  continue;
-		}
+	      mouse_motion_occured = 1;
 	      SDL_GetMouseState(&mouse_x, &mouse_y);
 	      if (event.window.windowID ==
 		  SDL_GetWindowID(screen[POINT_SCREEN]))
@@ -1999,8 +4165,9 @@ void mojave(double * data_flat, int32_t * color, int num_data, int dim_in,
 		       event.button.y < ZOOM_GROVE_Y + ZOOM_GROVE_HEIGHT &&
 		       event.button.button == SDL_BUTTON_LEFT)
 		{
-		  move_sliders(mouse_x - CONTROL_NUMBER_X, mouse_y, 0);
-		  refresh_flag = 1;
+		  if (!move_sliders(mouse_x - CONTROL_NUMBER_X, mouse_y, 0))
+		    refresh_flag = 1;
+		  else if (!refresh_flag) refresh_flag = REFRESH_TONE;
 		}
 	      break;	      
 	    case SDL_MOUSEBUTTONDOWN:
@@ -2024,15 +4191,18 @@ void mojave(double * data_flat, int32_t * color, int num_data, int dim_in,
 		  else if (event.window.windowID ==
 			   SDL_GetWindowID(screen[POINT_SCREEN]))
 		    {
-		      service_left_button_on_point(mouse_x, mouse_y,
+		      service_left_button_on_point(mouse_x, mouse_y, 1,
 						  data, color, hide, num_data);
+		      stroke_x = mouse_x;
+		      stroke_y = mouse_y;
 		      refresh_flag = 1;
 		    }
 		  break;
 		}
 	      break;
 	    case SDL_MOUSEBUTTONUP:
-	      undo_save(num_data, undo, undo_hide, color, hide);
+	      stroke_x = stroke_y = -1;
+	      undo_commit();
 	      break;
 	    case SDL_MOUSEWHEEL:
 	      if  (event.window.windowID ==
@@ -2081,9 +4251,58 @@ void mojave(double * data_flat, int32_t * color, int num_data, int dim_in,
 	      break;
 	    }
 	}
+      if (!flag) break;
+      if (motion_dx || motion_dy)
+	{
+	  SO_rotate(motion_dx, motion_dy);
+	  motion_dx = motion_dy = 0;
+	}
+
+      // Non-event driven rotation, KEYBOARD_ROTATION_DX/DY per 1/FPS seconds
+      Uint64 tick = SDL_GetPerformanceCounter();
+      double elapsed = (double) (tick - rotation_tick)
+	/ SDL_GetPerformanceFrequency();
+      if (elapsed > ROTATION_MAX_ELAPSED) elapsed = ROTATION_MAX_ELAPSED;
+      rotation_tick = tick;
+      if (rotation_mode & !mouse_motion_occured)
+	{
+	  SO_rotate(KEYBOARD_ROTATION_DX * FPS * elapsed,
+		    KEYBOARD_ROTATION_DY * FPS * elapsed);
+	  refresh_flag = 1;
+	}
+      
+      // Refresh logic, idle frames carry on drawing the points
+      if (!refresh_flag && perm_pending()) refresh_flag = REFRESH_MORE;
+      if (refresh_flag)
+	{
+	  // Point Screen	  
+          SDL_RenderClear(renderer[POINT_SCREEN]);
+          draw_points(num_data, data, color, hide, refresh_flag);
+	}
+      if (refresh_flag && refresh_flag != REFRESH_MORE)
+	{
+	  // Control screen
+	  Uint64 t0 = SDL_GetPerformanceCounter();
+	  draw_controls();
+	  refresh(CONTROL_SCREEN);
+	  stage_note(STAGE_CONTROLS, ms_since(t0));
+
+	  // Brush screen
+	  t0 = SDL_GetPerformanceCounter();
+	  draw_palette(num_data, data, color, hide);
+	  refresh(BRUSH_SCREEN);
+	  stage_note(STAGE_PALETTE, ms_since(t0));
+	}
+      int drawn = refresh_flag;
+      refresh_flag = 0;
+
+      // Whatever the stages did not account for, presenting and events
+      if (drawn) stage_note(STAGE_OTHER, ms_since(frame_tick) - stage_frame_ms);
       frame_time = SDL_GetTicks() - frame_start;
-      if (FRAME_DELAY > frame_time) SDL_Delay(FRAME_DELAY - frame_time);
+      unsigned frame_delay = 1000.0 / target_fps;
+      if (frame_delay > frame_time) SDL_Delay(frame_delay - frame_time);
     }
 
+  pool_quit();
   SDL_Quit();
 }